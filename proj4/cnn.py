@@ -1,9 +1,12 @@
 #!/usr/bin/python
 import BaseHTTPServer
 import SimpleHTTPServer
+import SocketServer
+import array
 import json
 import os
 import sys
+import time
 
 from cnnModule import *
 
@@ -12,6 +15,12 @@ if len(sys.argv) == 1:
 else:
     web_port_number = int(sys.argv[1])
 
+# Concurrent requests are classified together, in batches of up to
+# max_batch images. While a batch runs, the next one waits up to
+# max_delay_ms for more requests.
+max_batch = int(sys.argv[2]) if len(sys.argv) > 2 else 16
+max_delay_ms = float(sys.argv[3]) if len(sys.argv) > 3 else 1.0
+
 class webHandler(SimpleHTTPServer.SimpleHTTPRequestHandler):
 	def do_POST(self):
 		data_string = self.rfile.read(int(self.headers['Content-Length']))
@@ -24,9 +33,11 @@ class webHandler(SimpleHTTPServer.SimpleHTTPRequestHandler):
 		print '--------------------------------------------------------------------------------'
 		print 'RECEIVED CLASSIFICATION REQUEST: ' + ','.join([str(x) for x in samples])
 
-		dt = RunCNNClassifier(samples)
+		start = time.time()
+		likelihoods = array.array('d', str(batcher.classify(samples)))
+		dt = (time.time() - start) * 1000.0
 
-		responses = samples
+		responses = [0 if p > 0.5 else -1 for p in likelihoods]
 
 		print 'SENDING RESPONSES: ' + ','.join([str(x) for x in responses])
 		self.wfile.write(json.dumps({'dt':dt, 'r':responses}))
@@ -34,6 +45,10 @@ class webHandler(SimpleHTTPServer.SimpleHTTPRequestHandler):
 
 		return
 
+# Every request gets a thread of its own, so the batcher sees them all.
+class ThreadingServer(SocketServer.ThreadingMixIn, BaseHTTPServer.HTTPServer):
+	daemon_threads = True
+
 # -----------------------------------------------------------------------------
 
 print
@@ -41,7 +56,7 @@ print '          *** CS 61C, Spring 2017: Project 4 ***'
 print
 
 try:
-	server = BaseHTTPServer.HTTPServer(('', web_port_number), webHandler)
+	server = ThreadingServer(('', web_port_number), webHandler)
 	print 'Launched web server! Open your browser and open the following page:'
 	print
 	print 'http://localhost:%d' % web_port_number
@@ -49,6 +64,9 @@ try:
 	print 'Press CTRL+C to terminate'
 	
 	os.chdir('web')
+	# The network loads its snapshot relative to web/
+	model = Model()
+	batcher = Batcher(model, max_batch, max_delay_ms)
 	server.serve_forever()
 
 except KeyboardInterrupt:
@@ -0,0 +1,234 @@
+// A/B harness ----------------------------------------------------------------
+
+/*
+ * cnn-ab runs every layer of the optimized network (cnn.c) and of the
+ * reference network (cnnstart.c, see ref.c) on identical inputs, checks that
+ * their outputs agree and reports the speedup of every layer. It exits with
+ * status 1 if any layer disagrees, so it can gate every new kernel variant
+ * long before a wrong result shows up at the end of run_test.sh.
+ *
+ * The images of the data set go through the network in batches. The input
+ * of every layer is the output of the reference for the layer before it, so
+ * the error of one layer does not carry over into the next. The fused
+ * conv/relu/pool stages are compared against the three reference layers
+ * they replace.
+ *
+ * An output value passes if it is within a number of ULPs (units in the
+ * last place of real_t) of the reference value, or within a relative error
+ * of the largest reference value of its image. The second test is needed
+ * for values close to 0, which the optimized kernels get by summing in a
+ * different order, and whose ULPs are tiny. For the same reason, MAX ULPS
+ * only counts values that aren't within the relative error (a reference of
+ * exactly 0 would otherwise report millions of ULPs), so it is 0 if the
+ * second test passes for every value.
+ *
+ * Usage: cnn-ab [images] [--ulps n] [--rel r]
+ */
+
+#define CNN_NO_MAIN
+#include "cnn.c"
+
+#define AB_IMAGES 200
+#define AB_ULPS 64
+#define AB_REL (sizeof(real_t) == sizeof(float) ? 1e-5 : 1e-12)
+
+// The reference kernels, linked in from ref.c.
+void* ref_load_network(void);
+void ref_free_network(void* net);
+uint64_t ref_layer_forward(void* ref, int layer, const double* in, double* out, int n);
+
+#define AB_STAGES (LAYERS + 3)
+
+typedef struct ab_stage {
+  char name[16];
+  uint64_t ref_ns, opt_ns;
+  double max_ulps;     // largest error in ULPs of values outside rel
+  double max_rel;      // largest error relative to the largest value
+  long failed;         // values out of tolerance
+  long values;
+} ab_stage_t;
+
+/*
+ * Copy n volumes into a dense array in the layout of ref.c.
+ */
+
+static void vols_to_dense(vol_t** v, int n, double* out) {
+  for (int j = 0; j < n; j++)
+    for (int y = 0; y < (int)v[j]->sy; y++)
+      for (int x = 0; x < (int)v[j]->sx; x++)
+        for (int d = 0; d < (int)v[j]->depth; d++)
+          *out++ = get_vol(v[j], x, y, d);
+}
+
+static void dense_to_vols(const double* in, vol_t** v, int n) {
+  for (int j = 0; j < n; j++)
+    for (int y = 0; y < (int)v[j]->sy; y++)
+      for (int x = 0; x < (int)v[j]->sx; x++)
+        for (int d = 0; d < (int)v[j]->depth; d++)
+          set_vol(v[j], x, y, d, *in++);
+}
+
+// Distance between two real_t values one ULP apart, around x.
+static double ab_ulp(double x) {
+  if (sizeof(real_t) == sizeof(float))
+    return nextafterf(fabsf((float)x), INFINITY) - fabsf((float)x);
+  return nextafter(fabs(x), INFINITY) - fabs(x);
+}
+
+/*
+ * Compare the optimized output of n images (size values each) against the
+ * reference.
+ */
+
+static void ab_compare(ab_stage_t* s, const double* opt, const double* ref, int n, int size,
+                       double ulps, double rel) {
+  for (int j = 0; j < n; j++) {
+    const double* o = opt + (size_t)j * size;
+    const double* r = ref + (size_t)j * size;
+    double scale = 0.0;
+    for (int i = 0; i < size; i++)
+      if (fabs(r[i]) > scale)
+        scale = fabs(r[i]);
+
+    for (int i = 0; i < size; i++) {
+      double err = fabs(o[i] - r[i]);
+      double err_rel = (scale > 0.0) ? err / scale : err;
+      if (err_rel > s->max_rel)
+        s->max_rel = err_rel;
+      if (err_rel <= rel)
+        continue;
+
+      double err_ulps = err / ab_ulp(r[i]);
+      if (err_ulps > s->max_ulps)
+        s->max_ulps = err_ulps;
+      if (!(err_ulps <= ulps))
+        s->failed++;
+    }
+    s->values += size;
+  }
+}
+
+static void run_layer(network_t* net, int layer, batch_t* v, int n) {
+  switch (layer) {
+    case 0: conv_forward(net->l0, v[0], v[1], 0, n - 1); break;
+    case 1: relu_forward(net->l1, v[1], v[2], 0, n - 1); break;
+    case 2: pool_forward(net->l2, v[2], v[3], 0, n - 1); break;
+    case 3: conv_forward(net->l3, v[3], v[4], 0, n - 1); break;
+    case 4: relu_forward(net->l4, v[4], v[5], 0, n - 1); break;
+    case 5: pool_forward(net->l5, v[5], v[6], 0, n - 1); break;
+    case 6: conv_forward(net->l6, v[6], v[7], 0, n - 1); break;
+    case 7: relu_forward(net->l7, v[7], v[8], 0, n - 1); break;
+    case 8: pool_forward(net->l8, v[8], v[9], 0, n - 1); break;
+    case 9: fc_forward(net->l9, v[9], v[10], 0, n - 1); break;
+    case 10: softmax_forward(net->l10, v[10], v[11], 0, n - 1); break;
+  }
+}
+
+static void run_fused(network_t* net, int layer, batch_t* v, int n) {
+  conv_layer_t* conv[3] = { net->l0, net->l3, net->l6 };
+  pool_layer_t* pool[3] = { net->l2, net->l5, net->l8 };
+  conv_relu_pool_forward(conv[layer/3], pool[layer/3], v[layer], v[layer+3], 0, n - 1);
+}
+
+int main(int argc, char** argv) {
+  int images = AB_IMAGES;
+  double ulps = AB_ULPS, rel = AB_REL;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--ulps") && i + 1 < argc)
+      ulps = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--rel") && i + 1 < argc)
+      rel = atof(argv[++i]);
+    else if (atoi(argv[i]) > 0)
+      images = atoi(argv[i]);
+    else {
+      fprintf(stderr, "Usage: ./cnn-ab [images] [--ulps n] [--rel r]\n");
+      return 2;
+    }
+  }
+
+  network_t* net = load_cnn_snapshot(NET_HALO);
+  void* ref = ref_load_network();
+  int bs = net->batch_size;
+  // Every volume gets its own memory, so every layer has a valid input.
+  plan_memory(net, 1, &net->plan);
+  batch_t* v = make_batch(net, bs);
+
+  int max_size = 0;
+  for (int i = 0; i < LAYERS+1; i++)
+    if ((int)vol_size(net->v[i]) > max_size)
+      max_size = vol_size(net->v[i]);
+  double* opt = (double*)malloc(sizeof(double) * max_size * bs);
+  double* refs[LAYERS+1];
+  for (int i = 0; i < LAYERS+1; i++)
+    refs[i] = (double*)malloc(sizeof(double) * vol_size(net->v[i]) * bs);
+
+  ab_stage_t stages[AB_STAGES];
+  memset(stages, 0, sizeof(stages));
+  for (int i = 0; i < LAYERS; i++) {
+    snprintf(stages[i].name, sizeof(stages[i].name), "%s%d", layer_type[i], i);
+  }
+  for (int c = 0; c < 3; c++) {
+    snprintf(stages[LAYERS+c].name, sizeof(stages[LAYERS+c].name), "fused%d", 3*c);
+  }
+
+  for (int first = 0; first < images; first += bs) {
+    int n = (images - first < bs) ? images - first : bs;
+    for (int j = 0; j < n; j++)
+      image_to_vol(v[0][j], get_image(first + j));
+    vols_to_dense(v[0], n, refs[0]);
+
+    for (int i = 0; i < LAYERS; i++) {
+      ab_stage_t* s = &stages[i];
+      // The reference output of the layer before, rounded to real_t, is the
+      // input of both.
+      dense_to_vols(refs[i], v[i], n);
+      vols_to_dense(v[i], n, refs[i]);
+      s->ref_ns += ref_layer_forward(ref, i, refs[i], refs[i+1], n);
+
+      uint64_t t0 = timestamp_ns();
+      run_layer(net, i, v, n);
+      s->opt_ns += timestamp_ns() - t0;
+      vols_to_dense(v[i+1], n, opt);
+      ab_compare(s, opt, refs[i+1], n, vol_size(net->v[i+1]), ulps, rel);
+    }
+
+    for (int c = 0; c < 3; c++) {
+      ab_stage_t* s = &stages[LAYERS+c];
+      dense_to_vols(refs[3*c], v[3*c], n);
+      uint64_t t0 = timestamp_ns();
+      run_fused(net, 3*c, v, n);
+      s->opt_ns += timestamp_ns() - t0;
+      vols_to_dense(v[3*c+3], n, opt);
+      ab_compare(s, opt, refs[3*c+3], n, vol_size(net->v[3*c+3]), ulps, rel);
+    }
+  }
+  for (int c = 0; c < 3; c++)
+    for (int k = 0; k < 3; k++)
+      stages[LAYERS+c].ref_ns += stages[3*c+k].ref_ns;
+
+  printf("%s PRECISION, %s KERNELS, %d IMAGES, TOLERANCE %g ULPS OR %g RELATIVE\n\n",
+         sizeof(real_t) == sizeof(float) ? "SINGLE" : "DOUBLE", cnn_kernels()->name, images,
+         ulps, rel);
+  printf("LAYER       REF (ms)  OPT (ms)  SPEEDUP   MAX ULPS   MAX REL  RESULT\n");
+  int failed = 0;
+  for (int k = 0; k < AB_STAGES; k++) {
+    ab_stage_t* s = &stages[k];
+    printf("%-10s %9.2f %9.2f %7.1fx %10.3g %9.2e  ", s->name, s->ref_ns / 1e6, s->opt_ns / 1e6,
+           (double)s->ref_ns / s->opt_ns, s->max_ulps, s->max_rel);
+    if (s->failed > 0) {
+      printf("FAILED (%ld of %ld values)\n", s->failed, s->values);
+      failed = 1;
+    } else {
+      printf("OK\n");
+    }
+  }
+  printf("\n%s\n", failed ? "SOME LAYERS DISAGREE WITH THE REFERENCE" : "ALL LAYERS AGREE");
+
+  for (int i = 0; i < LAYERS+1; i++)
+    free(refs[i]);
+  free(opt);
+  free_batch(v, bs);
+  free_network(net);
+  ref_free_network(ref);
+  return failed;
+}
@@ -0,0 +1,237 @@
+// Request Batching -----------------------------------------------------------
+
+/*
+ * A server gets many small requests at once, each of which would run as a
+ * tiny batch on its own. A batcher queues the requests of any number of
+ * threads, and BATCHER_DISPATCHERS dispatcher threads run them together, in
+ * batches of up to max_batch images:
+ *
+ *  - If no batch is running, the workers are idle, and a dispatcher runs
+ *    whatever is queued right away. Waiting would only add latency.
+ *  - While a batch runs, the next dispatcher waits until max_batch images
+ *    are queued, until the oldest request has waited max_delay_us, or until
+ *    the running batch is done, whichever comes first. So the batches grow
+ *    with the load, and the next batch is ready when the workers are.
+ *  - A dispatcher takes whole requests from the front of the queue, as long
+ *    as they fit into max_batch images (a larger request goes alone), runs
+ *    them through net_classify_images_timed as one batch, and copies every
+ *    request's results back to it.
+ *
+ * batcher_classify blocks the calling thread until its results are in.
+ */
+
+#define BATCHER_DISPATCHERS 2
+
+typedef struct batch_request {
+  const uint8_t** input;
+  double* output;
+  uint64_t* done;          // or NULL
+  int n;
+  int finished;
+  uint64_t queued_ns;
+  struct batch_request* next;
+} batch_request_t;
+
+typedef struct batcher {
+  network_t* net;
+  int max_batch;
+  uint64_t max_delay_ns;
+
+  batch_request_t* head;   // FIFO queue of requests
+  batch_request_t* tail;
+  int queued;              // images in the queue
+  int running;             // batches being classified
+  int stop;
+
+  // requests, batches and images dispatched (since batcher_reset_stats)
+  long requests, batches, images;
+
+  pthread_t dispatchers[BATCHER_DISPATCHERS];
+  pthread_mutex_t lock;
+  pthread_cond_t queue_cond;  // signals the dispatchers
+  pthread_cond_t done_cond;   // signals the waiting callers
+} batcher_t;
+
+static void* batcher_main(void* arg) {
+  batcher_t* b = (batcher_t*)arg;
+  int cap = b->max_batch;
+  const uint8_t** input = (const uint8_t**)malloc(sizeof(uint8_t*) * cap);
+  double* output = (double*)malloc(sizeof(double) * cap);
+  uint64_t* done = (uint64_t*)malloc(sizeof(uint64_t) * cap);
+
+  pthread_mutex_lock(&b->lock);
+  for (;;) {
+    while (b->head == NULL && !b->stop)
+      pthread_cond_wait(&b->queue_cond, &b->lock);
+    if (b->head == NULL)
+      break;
+
+    // While the workers are busy, wait for a full batch, up to max_delay_ns
+    // after the oldest request.
+    uint64_t deadline = b->head->queued_ns + b->max_delay_ns;
+    while (b->running > 0 && b->head != NULL && b->queued < b->max_batch && !b->stop &&
+           timestamp_ns() < deadline) {
+      struct timespec ts = { deadline / 1000000000, deadline % 1000000000 };
+      pthread_cond_timedwait(&b->queue_cond, &b->lock, &ts);
+    }
+    if (b->head == NULL)
+      continue;  // taken by the other dispatcher
+
+    batch_request_t* first = b->head;
+    batch_request_t* last = first;
+    int n = first->n;
+    while (last->next != NULL && n + last->next->n <= b->max_batch) {
+      last = last->next;
+      n += last->n;
+    }
+    b->head = last->next;
+    if (b->head == NULL)
+      b->tail = NULL;
+    b->queued -= n;
+    b->running++;
+    pthread_mutex_unlock(&b->lock);
+
+    if (n > cap) {
+      cap = n;
+      input = (const uint8_t**)realloc(input, sizeof(uint8_t*) * cap);
+      output = (double*)realloc(output, sizeof(double) * cap);
+      done = (uint64_t*)realloc(done, sizeof(uint64_t) * cap);
+    }
+    int requests = 0;
+    int k = 0;
+    for (batch_request_t* r = first; ; r = r->next) {
+      memcpy(input + k, r->input, sizeof(uint8_t*) * r->n);
+      k += r->n;
+      requests++;
+      if (r == last)
+        break;
+    }
+
+    uint64_t t0 = trace_begin();
+    net_classify_images_timed(b->net, input, output, n, done);
+    trace_end("dispatch", -1, "images", n, t0);
+
+    pthread_mutex_lock(&b->lock);
+    k = 0;
+    for (batch_request_t* r = first; ; ) {
+      // The caller may return as soon as finished is set.
+      batch_request_t* next = r->next;
+      int end = (r == last);
+      memcpy(r->output, output + k, sizeof(double) * r->n);
+      if (r->done != NULL)
+        memcpy(r->done, done + k, sizeof(uint64_t) * r->n);
+      k += r->n;
+      r->finished = 1;
+      if (end)
+        break;
+      r = next;
+    }
+    b->requests += requests;
+    b->batches++;
+    b->images += n;
+    b->running--;
+    pthread_cond_broadcast(&b->done_cond);
+    // The workers are free, which a waiting dispatcher needs to know.
+    pthread_cond_broadcast(&b->queue_cond);
+  }
+  pthread_mutex_unlock(&b->lock);
+
+  free((void*)input);
+  free(output);
+  free(done);
+  return NULL;
+}
+
+/*
+ * Start a batcher for net, which has to stay alive until free_batcher. The
+ * workspaces of all workers are reserved here, since the batches may run
+ * next to other classifications.
+ */
+
+batcher_t* make_batcher(network_t* net, int max_batch, int max_delay_us) {
+  assert(max_batch > 0 && max_delay_us >= 0);
+  net_reserve_workspaces(net, sched_max_workers());
+
+  batcher_t* b = (batcher_t*)calloc(1, sizeof(batcher_t));
+  b->net = net;
+  b->max_batch = max_batch;
+  b->max_delay_ns = 1000ULL * max_delay_us;
+
+  pthread_mutex_init(&b->lock, NULL);
+  // Deadlines are timestamp_ns values.
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&b->queue_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_cond_init(&b->done_cond, NULL);
+
+  for (int i = 0; i < BATCHER_DISPATCHERS; i++)
+    pthread_create(&b->dispatchers[i], NULL, batcher_main, b);
+  return b;
+}
+
+/*
+ * Classify n raw images as part of the next batch, like net_classify_images
+ * (done as for net_classify_images_timed). Called by any number of threads
+ * at once.
+ */
+
+void batcher_classify(batcher_t* b, const uint8_t** input, double* output, int n,
+                      uint64_t* done) {
+  if (n == 0)
+    return;
+  batch_request_t r = { input, output, done, n, 0, timestamp_ns(), NULL };
+
+  pthread_mutex_lock(&b->lock);
+  if (b->tail != NULL)
+    b->tail->next = &r;
+  else
+    b->head = &r;
+  b->tail = &r;
+  b->queued += n;
+  // Both dispatchers may be waiting, for different things.
+  pthread_cond_broadcast(&b->queue_cond);
+
+  while (!r.finished)
+    pthread_cond_wait(&b->done_cond, &b->lock);
+  pthread_mutex_unlock(&b->lock);
+}
+
+/*
+ * Forget the requests dispatched so far, e.g. the warmup of a benchmark.
+ */
+
+void batcher_reset_stats(batcher_t* b) {
+  pthread_mutex_lock(&b->lock);
+  b->requests = 0;
+  b->batches = 0;
+  b->images = 0;
+  pthread_mutex_unlock(&b->lock);
+}
+
+void batcher_print_stats(batcher_t* b, FILE* f) {
+  pthread_mutex_lock(&b->lock);
+  fprintf(f, "BATCHER: %ld requests in %ld batches, %.1f images per batch\n", b->requests,
+          b->batches, (b->batches > 0) ? (double)b->images / b->batches : 0.0);
+  pthread_mutex_unlock(&b->lock);
+}
+
+/*
+ * Stop the dispatchers, once all requests are done (no thread may still be
+ * calling batcher_classify).
+ */
+
+void free_batcher(batcher_t* b) {
+  pthread_mutex_lock(&b->lock);
+  b->stop = 1;
+  pthread_cond_broadcast(&b->queue_cond);
+  pthread_mutex_unlock(&b->lock);
+  for (int i = 0; i < BATCHER_DISPATCHERS; i++)
+    pthread_join(b->dispatchers[i], NULL);
+
+  pthread_cond_destroy(&b->done_cond);
+  pthread_cond_destroy(&b->queue_cond);
+  pthread_mutex_destroy(&b->lock);
+  free(b);
+}
@@ -0,0 +1,231 @@
+// Kernel microbenchmarks -----------------------------------------------------
+
+/*
+ * cnn-bench times every kernel of the network on its own: the three conv
+ * layer shapes, the fused conv/relu/pool stages that the classification
+ * actually runs, relu, pool, fc and softmax. The inputs and weights are
+ * random, so no data set or snapshot is needed. Every kernel runs on a batch
+ * of images (net->batch_size by default) for a number of warmup rounds, and
+ * then a number of timed repetitions, of which the median and the 95th
+ * percentile are reported.
+ *
+ * The achieved GFLOP/s and GB/s (from the cost model of net_layer_cost) are
+ * compared against a roofline of this machine, measured on one thread like
+ * the kernels: the peak FLOP rate of the vector multiply-add (see the peak
+ * kernel), and the bandwidth of streaming a buffer through the relu kernel,
+ * once for a buffer that fits into the L2 cache and once for one far larger
+ * than all caches. A kernel whose data for one call fits into L2 is held to
+ * the L2 roof, any other kernel to the DRAM roof.
+ *
+ * Usage: cnn-bench [repetitions] [batch size]
+ */
+
+#define CNN_NO_MAIN
+#include "cnn.c"
+
+#define BENCH_WARMUP 10
+#define BENCH_REPS 200
+#define BENCH_DRAM_BYTES (256L << 20)
+#define BENCH_DEFAULT_L2 (256L << 10)
+
+typedef struct bench {
+  const char* name;
+  int layer;    // for the cost model
+  int fused;    // conv/relu/pool stage starting at layer
+} bench_t;
+
+static const bench_t benches[] = {
+  { "conv0", 0, 0 }, { "conv3", 3, 0 }, { "conv6", 6, 0 },
+  { "fused0", 0, 1 }, { "fused3", 3, 1 }, { "fused6", 6, 1 },
+  { "relu1", 1, 0 }, { "relu4", 4, 0 }, { "relu7", 7, 0 },
+  { "pool2", 2, 0 }, { "pool5", 5, 0 }, { "pool8", 8, 0 },
+  { "fc9", 9, 0 }, { "softmax10", 10, 0 },
+};
+
+#define NUM_BENCHES (int)(sizeof(benches) / sizeof(benches[0]))
+
+static double bench_random(unsigned int* seed) {
+  return (double)rand_r(seed) / RAND_MAX - 0.5;
+}
+
+static void fill_random(vol_t* v, unsigned int* seed) {
+  for (int y = 0; y < (int)v->sy; y++)
+    for (int x = 0; x < (int)v->sx; x++)
+      for (int d = 0; d < (int)v->depth; d++)
+        set_vol(v, x, y, d, bench_random(seed));
+}
+
+/*
+ * The network with random weights, packed like a loaded snapshot.
+ */
+
+static network_t* make_bench_network(int batch_size, unsigned int* seed) {
+  network_t* net = make_network(NET_HALO);
+  net->batch_size = batch_size;
+  conv_layer_t* conv[3] = { net->l0, net->l3, net->l6 };
+  for (int c = 0; c < 3; c++) {
+    for (int d = 0; d < conv[c]->out_depth; d++)
+      fill_random(conv[c]->filters[d], seed);
+    fill_random(conv[c]->biases, seed);
+    conv_pack(conv[c]);
+  }
+  for (int d = 0; d < net->l9->out_depth; d++)
+    fill_random(net->l9->filters[d], seed);
+  fill_random(net->l9->biases, seed);
+  fc_pack(net->l9);
+
+  // Every volume gets its own memory, so every kernel has a valid input.
+  plan_memory(net, 1, &net->plan);
+  return net;
+}
+
+static void run_bench(network_t* net, const bench_t* b, batch_t* v, int end) {
+  conv_layer_t* conv[3] = { net->l0, net->l3, net->l6 };
+  relu_layer_t* relu[3] = { net->l1, net->l4, net->l7 };
+  pool_layer_t* pool[3] = { net->l2, net->l5, net->l8 };
+  int i = b->layer;
+
+  if (b->fused)
+    conv_relu_pool_forward(conv[i/3], pool[i/3], v[i], v[i+3], 0, end);
+  else if (i == 9)
+    fc_forward(net->l9, v[9], v[10], 0, end);
+  else if (i == 10)
+    softmax_forward(net->l10, v[10], v[11], 0, end);
+  else if (i % 3 == 0)
+    conv_forward(conv[i/3], v[i], v[i+1], 0, end);
+  else if (i % 3 == 1)
+    relu_forward(relu[i/3], v[i], v[i+1], 0, end);
+  else
+    pool_forward(pool[i/3], v[i], v[i+1], 0, end);
+}
+
+static int compare_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * Peak FLOP rate of one thread, best of a few runs.
+ */
+
+static double measure_peak_gflops(void) {
+  const cnn_kernels_t* isa = cnn_kernels();
+  long n = 1L << 24;
+  double best = 0.0;
+  volatile real_t sink;
+  for (int r = 0; r < 5; r++) {
+    uint64_t t0 = timestamp_ns();
+    sink = isa->peak(n);
+    uint64_t t1 = timestamp_ns();
+    double rate = 2.0 * 8 * isa->nr * n / (t1 - t0);
+    if (rate > best)
+      best = rate;
+  }
+  (void)sink;
+  return best;
+}
+
+/*
+ * Bandwidth of one thread reading and writing a buffer of size bytes, best
+ * of a few runs. The buffer is walked often enough to take at least about
+ * as long as one walk through BENCH_DRAM_BYTES.
+ */
+
+static double measure_stream_gbs(long size) {
+  const cnn_kernels_t* isa = cnn_kernels();
+  long n = size / 2 / sizeof(real_t);
+  long chunk = (n < (1L << 20)) ? n : (1L << 20);
+  long walks = (BENCH_DRAM_BYTES + size - 1) / size;
+  real_t* in = (real_t*)_mm_malloc(sizeof(real_t) * n, 64);
+  real_t* out = (real_t*)_mm_malloc(sizeof(real_t) * n, 64);
+  for (long i = 0; i < n; i++) {
+    in[i] = (i & 1) ? 1.0 : -1.0;
+    out[i] = 0.0;
+  }
+
+  double best = 0.0;
+  for (int r = 0; r < 5; r++) {
+    uint64_t t0 = timestamp_ns();
+    for (long w = 0; w < walks; w++)
+      for (long i = 0; i < n; i += chunk)
+        isa->relu(out + i, in + i, (n - i < chunk) ? n - i : chunk);
+    uint64_t t1 = timestamp_ns();
+    double rate = 2.0 * sizeof(real_t) * n * walks / (t1 - t0);
+    if (rate > best)
+      best = rate;
+  }
+
+  _mm_free(in);
+  _mm_free(out);
+  return best;
+}
+
+int main(int argc, char** argv) {
+  int reps = (argc > 1) ? atoi(argv[1]) : BENCH_REPS;
+  int batch_size = (argc > 2) ? atoi(argv[2]) : DEFAULT_BATCH_SIZE;
+  if (reps < 1 || batch_size < 1) {
+    fprintf(stderr, "Usage: ./cnn-bench [repetitions] [batch size]\n");
+    return 2;
+  }
+
+  unsigned int seed = 61;
+  network_t* net = make_bench_network(batch_size, &seed);
+  batch_t* v = make_batch(net, batch_size);
+  for (int i = 0; i < LAYERS+1; i++)
+    for (int j = 0; j < batch_size; j++)
+      fill_random(v[i][j], &seed);
+
+  long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  if (l2 <= 0)
+    l2 = BENCH_DEFAULT_L2;
+  double peak_gflops = measure_peak_gflops();
+  double l2_gbs = measure_stream_gbs(l2 / 2);
+  double dram_gbs = measure_stream_gbs(BENCH_DRAM_BYTES);
+
+  printf("%s PRECISION, %s KERNELS, BATCHES OF %d IMAGES, %d REPETITIONS\n",
+         sizeof(real_t) == sizeof(float) ? "SINGLE" : "DOUBLE", cnn_kernels()->name,
+         batch_size, reps);
+  printf("ROOFLINE (1 THREAD): %.2f GFLOP/s, L2 (%ld KB) %.2f GB/s, DRAM %.2f GB/s\n\n",
+         peak_gflops, l2 >> 10, l2_gbs, dram_gbs);
+  printf("KERNEL      MEDIAN (us)  P95 (us)  GFLOP/s     GB/s  FLOP/B  BOUND     %% ROOF\n");
+
+  uint64_t* times = (uint64_t*)malloc(sizeof(uint64_t) * reps);
+  for (int k = 0; k < NUM_BENCHES; k++) {
+    const bench_t* b = &benches[k];
+    for (int r = 0; r < BENCH_WARMUP; r++)
+      run_bench(net, b, v, batch_size - 1);
+    for (int r = 0; r < reps; r++) {
+      uint64_t t0 = timestamp_ns();
+      run_bench(net, b, v, batch_size - 1);
+      times[r] = timestamp_ns() - t0;
+    }
+    qsort(times, reps, sizeof(uint64_t), compare_u64);
+    uint64_t median = times[reps / 2];
+    uint64_t p95 = times[(int)(0.95 * (reps - 1))];
+
+    double flops, act_bytes, param_bytes;
+    int flags = net->flags;
+    if (b->fused)
+      net->flags |= NET_FUSED;
+    net_layer_cost(net, b->layer, &flops, &act_bytes, &param_bytes);
+    net->flags = flags;
+    flops *= batch_size;
+    double bytes = act_bytes * batch_size + param_bytes;
+
+    // The roofline: attainable rate at this arithmetic intensity.
+    int in_l2 = bytes <= l2;
+    double gbs = in_l2 ? l2_gbs : dram_gbs;
+    double intensity = flops / bytes;
+    int memory_bound = intensity * gbs < peak_gflops;
+    double roof = memory_bound ? intensity * gbs : peak_gflops;
+    double gflops = flops / median;
+    printf("%-10s %12.2f %9.2f %8.2f %8.2f %7.2f  %-8s %6.1f%%\n", b->name, median / 1e3,
+           p95 / 1e3, gflops, bytes / median, intensity,
+           !memory_bound ? "compute" : in_l2 ? "L2" : "DRAM", 100.0 * gflops / roof);
+  }
+
+  free(times);
+  free_batch(v, batch_size);
+  free_network(net);
+  return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
@@ -5,6 +6,14 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 #include "timestamp.c"
 
 // Include SSE intrinsics
@@ -15,8 +24,21 @@
 #include <x86intrin.h>
 #endif
 
-// Include OpenMP
-#include <omp.h>
+// Precision ------------------------------------------------------------------
+
+/*
+ * All activations and weights are stored as real_t. This is double by
+ * default; building with -DCNN_FLOAT switches the whole network to single
+ * precision, which doubles the number of lanes in every vector register and
+ * halves the memory traffic of every layer. The vector kernels are written
+ * only once for both precisions (see kernels.c).
+ */
+
+#ifdef CNN_FLOAT
+typedef float real_t;
+#else
+typedef double real_t;
+#endif
 
 // Vol ------------------------------------------------------------------------
 
@@ -30,65 +52,105 @@
 
 /*
  * Represents a three-dimensional array of numbers, and its size. The numbers
- * at (x,y,d) are stored in array w at location ((v->sx * y)+x)*v->depth+d.
+ * at (x,y,d) are stored in array w at location (v->ystride * y)+x*v->depth+d.
+ * For a regular volume, ystride is sx*depth, so this is the dense location
+ * ((v->sx * y)+x)*v->depth+d.
+ *
+ * A volume can optionally be surrounded by a halo of pad zero pixels on each
+ * side (see vol_layout). Then w points at pixel (0,0) inside the allocation,
+ * the halo can be read at negative or past-the-end coordinates, and every
+ * row starts on a 64 byte boundary. The allocation starts offset values
+ * before w.
  */
 
 typedef struct vol {
   uint64_t sx,sy,depth;
-  double* w;
+  real_t* w;
+  uint64_t pad,ystride,offset;
 } vol_t;
 
+// Alignment of rows in a padded volume, in real_ts.
+#define VOL_ALIGN (64 / sizeof(real_t))
+
 /*
  * Set the value at a specific entry of the array.
  */
 
-static inline double get_vol(vol_t* v, int x, int y, int d) {
-  return v->w[((v->sx * y)+x)*v->depth+d];
+static inline real_t get_vol(vol_t* v, int x, int y, int d) {
+  return v->w[(v->ystride * y)+x*v->depth+d];
 }
 
 /*
  * Get the value at a specific entry of the array.
  */
 
-static inline void set_vol(vol_t* v, int x, int y, int d, double val) {
-  v->w[((v->sx * y)+x)*v->depth+d] = val;
+static inline void set_vol(vol_t* v, int x, int y, int d, real_t val) {
+  v->w[(v->ystride * y)+x*v->depth+d] = val;
 }
 
 /*
- * Allocate a new array with specific dimensions and default value v.
+ * Set up the layout of v for a halo of pad pixels and return the number of
+ * real_ts it needs. With a halo, the left halo of each row is extended so
+ * that pixel (0,y) is 64 byte aligned, and rows are padded to 64 bytes.
  */
 
-static vol_t* make_vol(int sx, int sy, int d, double v) {
+static uint64_t vol_layout(vol_t* v, int pad) {
+  uint64_t xoff = 0;
+  v->pad = pad;
+  v->ystride = v->sx * v->depth;
+  if (pad > 0) {
+    xoff = (pad * v->depth + VOL_ALIGN - 1) & ~(VOL_ALIGN - 1);
+    v->ystride = (xoff + (v->sx + pad) * v->depth + VOL_ALIGN - 1) & ~(VOL_ALIGN - 1);
+  }
+  v->offset = pad * v->ystride + xoff;
+  return (v->sy + 2 * pad) * v->ystride;
+}
+
+/*
+ * Allocate a new array with specific dimensions, a zero halo of pad pixels
+ * and default value v.
+ */
+
+static vol_t* make_vol_padded(int sx, int sy, int d, int pad, real_t v) {
   vol_t* out = (vol_t*)malloc(sizeof(struct vol));
-  out->w = (double*)malloc(sizeof(double)*(sx*sy*d));
   out->sx = sx;
   out->sy = sy;
   out->depth = d;
-int x,y,z;
-#pragma opm parallel for private(x,y,z)
-  for (int z = 0; z < d; z++)
-    for (int y = 0; y < sy; y++)
-     	for (int x = 0; x < sx; x ++)
-        	set_vol(out, x, y, z, v);
+  uint64_t size = vol_layout(out, pad);
+  real_t* mem = (real_t*)_mm_malloc(sizeof(real_t)*size, 64);
+  memset(mem, 0, sizeof(real_t)*size);
+  out->w = mem + out->offset;
+  for (int y = 0; y < sy; y++)
+    for (int x = 0; x < sx; x++)
+      for (int z = 0; z < d; z++)
+        set_vol(out, x, y, z, v);
   return out;
 }
+
+/*
+ * Allocate a new array with specific dimensions and default value v.
+ */
+
+static vol_t* make_vol(int sx, int sy, int d, real_t v) {
+  return make_vol_padded(sx, sy, d, 0, v);
+}
+
 /*
  * Copy the contents of one Volume to another (assuming same dimensions).
+ * Rows are contiguous in both, even if their halos differ.
  */
 
-static vol_t* copy_vol(vol_t* dest, vol_t* src) {
-int x,y,z;
-#pragma opm parallel for private(x,y,z)
-  for (int x = 0; x < dest->sx; x++)
-    for (int y = 0; y < dest->sy; y++)
-      for (int z = 0; z < dest->depth; z++)
-        set_vol(dest, x, y, z, get_vol(src, x, y, z));
+static void copy_vol(vol_t* dest, vol_t* src) {
+  for (int y = 0; y < dest->sy; y++)
+    memcpy(dest->w + dest->ystride * y, src->w + src->ystride * y,
+           sizeof(real_t) * dest->sx * dest->depth);
 }
+
 /*
  * Deallocate the array.
  */
 void free_vol(vol_t* v) {
-  free(v->w);
+  _mm_free(v->w - v->offset);
   free(v);
 }
 
@@ -110,6 +172,32 @@ void free_vol(vol_t* v) {
  * function you need to consider is the _forward function.
  */
 
+#include "gemm.c"
+#include "isa.c"
+#include "sched.c"
+#include "trace.c"
+#include "profile.c"
+
+// Kernel Scratch -------------------------------------------------------------
+
+/*
+ * The gemm based kernels need scratch memory for their im2col patches and
+ * result tiles, up to about half a MB for the deeper layers, which is too
+ * much for the stack of a thread. Each takes a scratch pointer of at least
+ * the size its _scratch_size function gives (in real_t values): a network
+ * keeps one in every workspace (see net_scratch). Called with NULL, e.g.
+ * by a thread without a workspace, a kernel allocates its own for the call.
+ */
+
+static real_t* scratch_get(real_t* scratch, size_t size) {
+  return (scratch != NULL) ? scratch : (real_t*)_mm_malloc(sizeof(real_t) * size, 64);
+}
+
+static void scratch_put(real_t* scratch, real_t* mem) {
+  if (mem != scratch)
+    _mm_free(mem);
+}
+
 // Convolutional Layer --------------------------------------------------------
 
 typedef struct conv_layer {
@@ -130,9 +218,14 @@ typedef struct conv_layer {
   // computed
   int out_sx;
   int out_sy;
-  double bias;
+  real_t bias;
   vol_t* biases;
   vol_t** filters;
+
+  // packed for gemm (see conv_pack)
+  real_t* packed;
+  real_t* packed_bias;
+  int packed_mapped;  // packed and packed_bias point into a snapshot mapping
 } conv_layer_t;
 
 conv_layer_t* make_conv_layer(int in_sx, int in_sy, int in_depth,
@@ -158,216 +251,167 @@ conv_layer_t* make_conv_layer(int in_sx, int in_sy, int in_depth,
   l->out_sy = floor((l->in_sy + l->pad * 2 - l->sy) / l->stride + 1);
 
   l->filters = (vol_t**)malloc(sizeof(vol_t*)*filters);
-int i;
 int lSx=l->sx;
 int lSy=l->sy;
 int ldep=l->in_depth;
-    #pragma omp parallel for private(i)
   for (int i = 0; i < filters ; i++) {
     l->filters[i] = make_vol(lSx, lSy, ldep, 0.0);
     }
   l->bias = 0.0;
   l->biases = make_vol(1, 1, l->out_depth, l->bias);
+  l->packed = NULL;
+  l->packed_bias = NULL;
+  l->packed_mapped = 0;
 
   return l;
 }
 
+/*
+ * Write the im2col patches of output pixels [p0, p0+m) of image V into col.
+ * Row r of col holds the sx*sy*in_depth input values that filter tap
+ * ((fy*sx)+fx)*in_depth+z is applied to for output pixel p0+r, which is the
+ * same order in which the filter weights are stored. Taps falling into the
+ * zero padding around the image are set to zero, or read from the halo of V
+ * if it has one.
+ */
 
-void conv_forward3(conv_layer_t* l, vol_t** in, vol_t** out, int start, int end) {
-double a=0.0;
-int fst,sec;
-int oy,ox;
-  for (int i = start; i <= end; i++) {
-    vol_t* V = in[i];
-    vol_t* A = out[i];
-    int V_sx = V->sx;
-    int V_sy = V->sy;
-    int xy_stride = l->stride;
-    int V_dep = V->depth;
-    int pad= -l->pad;
-    for(int d = 0; d < l->out_depth; d++) {
-      vol_t* f = l->filters[d];
-      int x = pad;
-      int y = pad;
-      int f_sx = f->sx;
-      for(int ay = 0; ay < 32/*l->out_sy*/; y += xy_stride, ay++) {
-        x=pad;
-        for(int ax=0; ax < 32/*l->out_sx*/; x += xy_stride, ax++) {
-          a = 0.0;
-          for(int fy = 0; fy < 5; fy++) {
-            oy = y + fy;
-	    if (oy > -1 && oy < 32/*V_sy*/){
-    	      for(int fx = 0; fx < 5 ; fx++) {
-                ox = x + fx;
-                if( ox > -1 && ox < 32) { 
-		  fst = ((5 * fy)+fx)*3;
-		  sec = ((32 * oy)+ox)*3;
-		  a += f->w[fst] * V->w[sec] +  f->w[fst+1] * V->w[sec+1] +  f->w[fst+2] * V->w[sec+2];
-                }
-	      }
-            }
-          }
-         a += l->biases->w[d];
-         set_vol(A, ax, ay, d, a);
-        }
+static void conv_im2col(conv_layer_t* l, vol_t* V, int p0, int m, real_t* col) {
+  int V_sx = V->sx;
+  int V_sy = V->sy;
+  int depth = l->in_depth;
+  int row_len = l->sx * depth;
+  int K = l->sy * row_len;
+
+  for (int r = 0; r < m; r++) {
+    int ay = (p0 + r) / l->out_sx;
+    int ax = (p0 + r) % l->out_sx;
+    int y = ay * l->stride - l->pad;
+    int x = ax * l->stride - l->pad;
+    real_t* dst = col + r * K;
+
+    // With a halo at least as wide as the padding, every tap is inside the
+    // allocation, so each filter row is a single branch-free copy.
+    if (V->pad >= l->pad) {
+      for (int fy = 0; fy < l->sy; fy++, dst += row_len)
+        memcpy(dst, V->w + V->ystride * (y + fy) + x * depth, sizeof(real_t)*row_len);
+      continue;
+    }
+
+    // Range of filter columns [fx0, fx1) that falls inside the image.
+    int fx0 = (x < 0) ? -x : 0;
+    int fx1 = (x + l->sx > V_sx) ? V_sx - x : l->sx;
+
+    for (int fy = 0; fy < l->sy; fy++, dst += row_len) {
+      int oy = y + fy;
+      if (oy < 0 || oy >= V_sy || fx0 >= fx1) {
+        memset(dst, 0, sizeof(real_t)*row_len);
+        continue;
       }
+      memset(dst, 0, sizeof(real_t)*fx0*depth);
+      memcpy(dst + fx0*depth, V->w + (V->ystride * oy)+(x+fx0)*depth,
+             sizeof(real_t)*(fx1-fx0)*depth);
+      memset(dst + fx1*depth, 0, sizeof(real_t)*(l->sx-fx1)*depth);
     }
   }
 }
 
+/*
+ * Raw images are kept the way they are stored in the CIFAR-10 files: depth
+ * planes (red, green, blue) of sx x sy bytes. pixel_norm maps a byte to the
+ * value the network sees, (x / 255) - 0.5.
+ */
+
+real_t pixel_norm[256];
+
+static void init_pixel_norm(void) {
+  for (int i = 0; i < 256; i++)
+    pixel_norm[i] = ((double)i)/255.0-0.5;
+}
+
+/*
+ * Normalize a raw image into the input volume v of the first conv layer
+ * (which may have a halo). v is small enough to stay in cache for the
+ * im2col that follows, so the input never exists as a volume in memory.
+ */
+
+void image_to_vol(vol_t* v, const uint8_t* img) {
+  int plane = v->sx * v->sy;
+  for (int y = 0; y < v->sy; y++) {
+    real_t* dst = v->w + v->ystride * y;
+    const uint8_t* src = img + v->sx * y;
+    for (int x = 0; x < v->sx; x++)
+      for (int d = 0; d < v->depth; d++)
+        dst[x * v->depth + d] = pixel_norm[src[x + d * plane]];
+  }
+}
+
+/*
+ * The convolution is lowered to a matrix multiply: for each block of
+ * GEMM_MC output pixels, we build the im2col patch matrix (one row per
+ * pixel) and multiply it with the filters that conv_load packed into
+ * l->packed. The result rows are written straight into the output volume.
+ *
+ * The _rows variants of the layers only compute output rows [y0, y1), so a
+ * layer can be split across workers (see net_forward_parallel).
+ */
+
+size_t conv_scratch_size(conv_layer_t* l) {
+  return (size_t)GEMM_MC * l->sx * l->sy * l->in_depth;
+}
+
+void conv_forward_rows(conv_layer_t* l, vol_t** in, vol_t** out, int start, int end,
+                       int y0, int y1, real_t* scratch) {
+  int K = l->sx * l->sy * l->in_depth;
+  int P = l->out_sx * y1;
+  real_t* col = scratch_get(scratch, conv_scratch_size(l));
 
-void conv_forward16(conv_layer_t* l, vol_t** in, vol_t** out, int start, int end) {
-int fst,sec;
-int oy,ox;
-//double tot=0;
-//#pragma omp parallel for
-//int fst,sec;
-//int oy,ox;
   for (int i = start; i <= end; i++) {
     vol_t* V = in[i];
     vol_t* A = out[i];
-    int V_sx = V->sx;
-    int V_sy = V->sy;
-    int xy_stride = l->stride;
-    int V_dep = V->depth;
-    int pad= -l->pad;
-    double* vVal = V->w;
-    for(int d = 0; d < l->out_depth; d++) {
-      vol_t* f = l->filters[d];
-      int x = pad;
-       double bias=l->biases->w[d];
-      int y = pad;
-      int f_sx = f->sx;
-      double* fval = f->w;
-	double a;
-      for(int ay = 0; ay < l->out_sy; y += xy_stride, ay++) {
-        x=pad;
-        for(int ax=0; ax < l->out_sx; x += xy_stride, ax++) {
-          a = 0.0;
-  	 double tot=0.0;
-          __m128d sum;
-          for(int fy = 0; fy < 5; fy++) {
-            oy = y + fy;
-            if (oy > -1 && oy < 16/*V_sy*/){
-              for(int fx = 0; fx < 5 ; fx++) {
-                ox = x + fx;
-                if( ox > -1 && ox < 16) {
-                int sec =((16 * oy)+ox)*16;
-                int fst= ((5 * fy)+fx)*16;
-                 __m256d fst1 =  _mm256_loadu_pd((double *)(fval +fst));
-                 __m256d fst2 =  _mm256_loadu_pd((double *)(fval +(fst+4)));
-                 __m256d fst3 =  _mm256_loadu_pd((double *)(fval +(fst+8)));
-                 __m256d fst4 =  _mm256_loadu_pd((double *)(fval +(fst+12)));
-                 __m256d sec1 = _mm256_loadu_pd((double *) (vVal+sec));
-                 __m256d sec2 = _mm256_loadu_pd((double *)(vVal + (sec + 4)));
-                 __m256d sec3 = _mm256_loadu_pd((double *) (vVal + (sec +8)));
-                 __m256d sec4 = _mm256_loadu_pd((double *)(vVal + (sec +12)));
-                  sec1 = _mm256_mul_pd(fst1, sec1);    sec2 = _mm256_mul_pd(fst2, sec2);
-                   sec3 = _mm256_mul_pd(fst3, sec3);    sec4 = _mm256_mul_pd(fst4, sec4);
-                   sec1 = _mm256_add_pd(sec1, sec2);    sec2 = _mm256_add_pd(sec3, sec4);
-                   sec1 = _mm256_add_pd(sec1, sec2);    sec1 = _mm256_hadd_pd(sec1,sec1);
-                   sum = _mm256_extractf128_pd(sec1,0);
-                   sum = _mm_add_pd(sum, _mm256_extractf128_pd(sec1,1));
-                   tot =  _mm_cvtsd_f64(sum);
-                   a += tot;
-                }
-              }
-            }
-          }
-         a += bias;
-         set_vol(A, ax, ay, d, a);
-        }
-      }
+    assert(A->pad == 0);
+    for (int p0 = l->out_sx * y0; p0 < P; p0 += GEMM_MC) {
+      int m = (P - p0 < GEMM_MC) ? P - p0 : GEMM_MC;
+      conv_im2col(l, V, p0, m, col);
+      gemm(m, l->out_depth, K, col, K, l->packed, l->packed_bias,
+           A->w + p0 * l->out_depth, l->out_depth);
     }
   }
+  scratch_put(scratch, col);
 }
 
+void conv_forward(conv_layer_t* l, vol_t** in, vol_t** out, int start, int end) {
+  conv_forward_rows(l, in, out, start, end, 0, l->out_sy, NULL);
+}
 
+/*
+ * Release the packed filters and biases (see conv_pack), unless they belong
+ * to a snapshot mapping (see snapshot_load).
+ */
 
-void conv_forward(conv_layer_t* l, vol_t** in, vol_t** out, int start, int end) {
-int dep=l->in_depth;
-  if (dep == 3) {
-    conv_forward3(l, in, out, start, end);
+void conv_free_packed(conv_layer_t* l) {
+  if (!l->packed_mapped) {
+    _mm_free(l->packed);
+    _mm_free(l->packed_bias);
   }
- else if (dep == 16) {
-    conv_forward16(l, in, out, start,end);
-  }
- else {
-//int d,ay, ax, fy, fx, fd;
-//#pragma omp parallel for private(d, ay, ax, fy, fx, fd)
-int fst,sec;
-int oy,ox;
-//#pragma omp parallel for private(d, ay, ax, fy, fx, fd) 
-//double tot=0;
-//#pragma omp parallel for
-//int fst,sec;
-//int oy,ox;
-  for (int i = start; i <= end; i++) {
-    vol_t* V = in[i];
-    vol_t* A = out[i];
-    int V_sx = V->sx;
-    int V_sy = V->sy;
-    int xy_stride = l->stride;
-    int V_dep = V->depth;
-    int pad= -l->pad;
-    double* vVal = V->w;
-    for(int d = 0; d < l->out_depth; d++) {
-      vol_t* f = l->filters[d];
-      int x = pad;
-       double bias=l->biases->w[d];
-      int y = pad;
-      int f_sx = f->sx;
-      double* fval = f->w;
-        double a;
-      for(int ay = 0; ay < 8; y += xy_stride, ay++) {
-        x=pad;
-        for(int ax=0; ax < 8; x += xy_stride, ax++) {
-          a = 0.0;
-         double tot=0.0;
-//printf("f->sx=%d   f->sy=%d   V->sx=%d   V->sy=%d      l_out_sx=%d    l_out_sy=%d\n",f->sx,f->sy,V->sx,V->sy,l->out_sx,l->out_sy );
-//printf("f->sx=%d   f->sy=%d ",f->depth, V->depth);
-          __m128d sum;
-          for(int fy = 0; fy < 5; fy++) {
-            oy = y + fy;
-            if (oy > -1 && oy < V_sy){
-              for(int fx = 0; fx < 5 ; fx++) {
-                ox = x + fx;
-                if( ox > -1 && ox < V_sx) {
-                int sec =((8 * oy)+ox)*20;
-                int fst= ((5 * fy)+fx)*20;
-                 __m256d fst1 =  _mm256_loadu_pd((double *)(fval +fst));
-                 __m256d fst2 =  _mm256_loadu_pd((double *)(fval +(fst+4)));
-                 __m256d fst3 =  _mm256_loadu_pd((double *)(fval +(fst+8)));
-                 __m256d fst4 =  _mm256_loadu_pd((double *)(fval +(fst+12)));
-                 __m256d fst5 =  _mm256_loadu_pd((double *)(fval +(fst+16)));
-                 __m256d sec1 = _mm256_loadu_pd((double *) (vVal+sec));
-                 __m256d sec2 = _mm256_loadu_pd((double *)(vVal + (sec + 4)));
-                 __m256d sec3 = _mm256_loadu_pd((double *) (vVal + (sec +8)));
-                 __m256d sec4 = _mm256_loadu_pd((double *)(vVal + (sec +12)));
-                 __m256d sec5 = _mm256_loadu_pd((double *)(vVal + (sec +16)));
-                  sec1 = _mm256_mul_pd(fst1, sec1);    sec2 = _mm256_mul_pd(fst2, sec2);
-                   sec3 = _mm256_mul_pd(fst3, sec3);    sec4 = _mm256_mul_pd(fst4, sec4);
-                   sec5 = _mm256_mul_pd(fst5, sec5);
-                   sec1 = _mm256_add_pd(sec1, sec2);    sec2 = _mm256_add_pd(sec3, sec4);
-                   sec1 = _mm256_add_pd(sec1, sec2);    sec1 = _mm256_add_pd(sec1, sec5);
-                   sec1 = _mm256_hadd_pd(sec1,sec1);
-                   sum = _mm256_extractf128_pd(sec1,0);
-                   sum = _mm_add_pd(sum, _mm256_extractf128_pd(sec1,1));
-                   tot =  _mm_cvtsd_f64(sum);
-                   a += tot;
-                }
-              }
-            }
-          }
-         a += bias;
-         set_vol(A, ax, ay, d, a);
-        }
-      }
-    }
-   }
- }
+  l->packed = NULL;
+  l->packed_bias = NULL;
+  l->packed_mapped = 0;
 }
 
+/*
+ * Pack the filters and biases into the layout used by gemm. This is done
+ * once after the weights have been loaded.
+ */
+
+void conv_pack(conv_layer_t* l) {
+  real_t* cols[l->out_depth];
+  for (int d = 0; d < l->out_depth; d++)
+    cols[d] = l->filters[d]->w;
+
+  conv_free_packed(l);
+  l->packed = gemm_pack_b(cols, l->sx * l->sy * l->in_depth, l->out_depth);
+  l->packed_bias = gemm_pack_bias(l->biases->w, l->out_depth);
+}
 
 void conv_load(conv_layer_t* l, const char* fn) {
   int sx, sy, depth, filters;
@@ -397,6 +441,8 @@ void conv_load(conv_layer_t* l, const char* fn) {
   }
 
   fclose(fin);
+
+  conv_pack(l);
 }
 
 // Relu Layer -----------------------------------------------------------------
@@ -429,15 +475,19 @@ typedef struct relu_layer {
   return l;
 }
 
-void relu_forward(relu_layer_t* l, vol_t** in, vol_t** out, int start, int end) {
-#pragma omp parallel for
+void relu_forward_rows(relu_layer_t* l, vol_t** in, vol_t** out, int start, int end,
+                       int y0, int y1) {
+  const cnn_kernels_t* isa = cnn_kernels();
+  int row = l->in_sx * l->in_depth;
   for (int j = start; j <= end; j++) {
-    for (int i = 0; i < l->in_sx*l->in_sy*l->in_depth; i++) {
-      out[j]->w[i] = (in[j]->w[i] < 0.0) ? 0.0 : in[j]->w[i];
-    }
+    isa->relu(out[j]->w + y0 * row, in[j]->w + y0 * row, (y1 - y0) * row);
   }
 }
 
+void relu_forward(relu_layer_t* l, vol_t** in, vol_t** out, int start, int end) {
+  relu_forward_rows(l, in, out, start, end, 0, l->out_sy);
+}
+
 // Pool Layer -----------------------------------------------------------------
 
 typedef struct pool_layer {
@@ -481,38 +531,118 @@ pool_layer_t* make_pool_layer(int in_sx, int in_sy, int in_depth,
   return l;
 }
 
-void pool_forward(pool_layer_t* l, vol_t** in, vol_t** out, int start, int end) {
+/*
+ * Every output pixel is the maximum of the depth rows of the input pixels in
+ * its window, so the window is reduced a whole row at a time.
+ */
+
+void pool_forward_rows(pool_layer_t* l, vol_t** in, vol_t** out, int start, int end,
+                       int y0, int y1) {
+  const cnn_kernels_t* isa = cnn_kernels();
+
   for (int i = start; i <= end; i++) {
     vol_t* V = in[i];
     vol_t* A = out[i];
-        
-    int n=0;
-    for(int d=0;d<l->out_depth;d++) {
-      int x = -l->pad;
-      int y = -l->pad;
-      for(int ax=0; ax<l->out_sx; x+=l->stride,ax++) {
-        y = -l->pad;
-        for(int ay=0; ay<l->out_sy; y+=l->stride,ay++) {
-  
-          double a = -99999;
+
+    for(int ay=y0; ay<y1; ay++) {
+      int y = -l->pad + ay * l->stride;
+      for(int ax=0; ax<l->out_sx; ax++) {
+        int x = -l->pad + ax * l->stride;
+        real_t* dst = A->w + (A->ystride * ay) + ax * l->out_depth;
+        for(int d=0;d<l->out_depth;d++)
+          dst[d] = -99999;
+
+        for(int fy=0;fy<l->sy;fy++) {
           for(int fx=0;fx<l->sx;fx++) {
-            for(int fy=0;fy<l->sy;fy++) {
-              int oy = y+fy;
-              int ox = x+fx;
-              if(oy>=0 && oy<V->sy && ox>=0 && ox<V->sx) {
-                double v = get_vol(V, ox, oy, d);
-                if(v > a) { a = v; }
-              }
-            }
+            int oy = y+fy;
+            int ox = x+fx;
+            if(oy>=0 && oy<V->sy && ox>=0 && ox<V->sx)
+              isa->vmax(dst, V->w + (V->ystride * oy) + ox * V->depth, l->out_depth);
           }
-          n++;
-          set_vol(A, ax, ay, d, a);
         }
       }
     }
   }
 }
 
+void pool_forward(pool_layer_t* l, vol_t** in, vol_t** out, int start, int end) {
+  pool_forward_rows(l, in, out, start, end, 0, l->out_sy);
+}
+
+// Fused Conv + Relu + Pool ---------------------------------------------------
+
+/*
+ * Run a conv layer, a relu and a pool layer in one sweep. The conv output is
+ * computed pool->sy rows at a time into a small tile that stays in cache, and
+ * the relu and max pooling are applied to the tile right away. Only the
+ * pooled volume is written to memory. This requires non-overlapping pooling
+ * windows that exactly cover the conv output (see can_fuse). Since max
+ * pooling and relu commute, the result is identical to running the layers.
+ *
+ * Batches are processed a group of images at a time: the same tile rows of
+ * all images in the group go through one gemm call, so each packed filter
+ * slice is loaded once and applied to up to FUSE_ROWS rows. This matters for
+ * the deeper layers, where one image only contributes a few rows per tile.
+ */
+
+#define FUSE_ROWS (4 * GEMM_MC)
+
+int can_fuse(conv_layer_t* cl, pool_layer_t* pl) {
+  return pl->sx == pl->stride && pl->sy == pl->stride && pl->pad == 0 &&
+         cl->out_sx == pl->out_sx * pl->sx && cl->out_sy == pl->out_sy * pl->sy;
+}
+
+// Images per gemm call, and output pixels per image and tile row.
+static int fuse_group(conv_layer_t* cl, pool_layer_t* pl, int* m) {
+  *m = pl->sy * cl->out_sx;
+  return (FUSE_ROWS / *m > 0) ? FUSE_ROWS / *m : 1;
+}
+
+size_t conv_relu_pool_scratch_size(conv_layer_t* cl, pool_layer_t* pl) {
+  int m;
+  int g = fuse_group(cl, pl, &m);
+  return (size_t)g * m * (cl->sx * cl->sy * cl->in_depth + cl->out_depth);
+}
+
+void conv_relu_pool_rows(conv_layer_t* cl, pool_layer_t* pl, vol_t** in, vol_t** out,
+                         int start, int end, int y0, int y1, real_t* scratch) {
+  int K = cl->sx * cl->sy * cl->in_depth;
+  int D = cl->out_depth;
+  int m;
+  int g = fuse_group(cl, pl, &m);
+  const cnn_kernels_t* isa = cnn_kernels();
+  real_t* col = scratch_get(scratch, conv_relu_pool_scratch_size(cl, pl));
+  real_t* tile = col + (size_t)g * m * K;
+
+  for (int i0 = start; i0 <= end; i0 += g) {
+    int gi = (end - i0 + 1 < g) ? end - i0 + 1 : g;
+    for (int ay = y0; ay < y1; ay++) {
+      for (int j = 0; j < gi; j++)
+        conv_im2col(cl, in[i0 + j], ay * m, m, col + j * m * K);
+      gemm(gi * m, D, K, col, K, cl->packed, cl->packed_bias, tile, D);
+
+      for (int j = 0; j < gi; j++) {
+        vol_t* A = out[i0 + j];
+        real_t* t = tile + j * m * D;
+        for (int ax = 0; ax < pl->out_sx; ax++) {
+          real_t* dst = A->w + (A->ystride * ay) + ax * D;
+          for (int d = 0; d < D; d++)
+            dst[d] = 0.0;
+          for (int fy = 0; fy < pl->sy; fy++)
+            for (int fx = 0; fx < pl->sx; fx++)
+              isa->vmax(dst, t + ((cl->out_sx * fy) + ax * pl->sx + fx) * D, D);
+        }
+      }
+    }
+  }
+  scratch_put(scratch, col);
+}
+
+void conv_relu_pool_forward(conv_layer_t* cl, pool_layer_t* pl, vol_t** in, vol_t** out,
+                            int start, int end) {
+  conv_relu_pool_rows(cl, pl, in, out, start, end, 0, pl->out_sy, NULL);
+}
+
 // FC Layer -------------------------------------------------------------------
 
 typedef struct fc_layer {
@@ -530,9 +660,14 @@ typedef struct fc_layer {
   int out_sx;
   int out_sy;
   int num_inputs;
-  double bias;
+  real_t bias;
   vol_t* biases;
   vol_t** filters;
+
+  // packed for gemm (see fc_pack)
+  real_t* packed;
+  real_t* packed_bias;
+  int packed_mapped;  // packed and packed_bias point into a snapshot mapping
 } fc_layer_t;
 
 fc_layer_t* make_fc_layer(int in_sx, int in_sy, int in_depth,
@@ -561,24 +696,82 @@ fc_layer_t* make_fc_layer(int in_sx, int in_sy, int in_depth,
 
   l->bias = 0.0;
   l->biases = make_vol(1, 1, l->out_depth, l->bias);
+  l->packed = NULL;
+  l->packed_bias = NULL;
+  l->packed_mapped = 0;
 
   return l;
 }
 
+/*
+ * A batch is computed as one matrix multiply: the inputs of up to FC_BATCH
+ * images are gathered into the rows of A (padded with zero rows to whole
+ * register tiles) and multiplied with the weight matrix that fc_load packed
+ * into l->packed. The weights are thus read once per FC_BATCH images instead
+ * of once per image.
+ */
+
+#define FC_BATCH 32
+
+size_t fc_scratch_size(fc_layer_t* l) {
+  return (size_t)FC_BATCH * (l->num_inputs + l->out_depth);
+}
+
+void fc_forward_scratch(fc_layer_t* l, vol_t** in, vol_t** out, int start, int end,
+                        real_t* scratch) {
+  int K = l->num_inputs;
+  int N = l->out_depth;
+  real_t* a = scratch_get(scratch, fc_scratch_size(l));
+  real_t* c = a + FC_BATCH * K;
+
+  for (int j0 = start; j0 <= end; j0 += FC_BATCH) {
+    int m = (end - j0 + 1 < FC_BATCH) ? end - j0 + 1 : FC_BATCH;
+    int mp = (m + GEMM_MR - 1) / GEMM_MR * GEMM_MR;
+
+    for (int r = 0; r < m; r++)
+      memcpy(a + r * K, in[j0 + r]->w, sizeof(real_t) * K);
+    memset(a + m * K, 0, sizeof(real_t) * (mp - m) * K);
+
+    gemm(mp, N, K, a, K, l->packed, l->packed_bias, c, N);
+
+    for (int r = 0; r < m; r++)
+      memcpy(out[j0 + r]->w, c + r * N, sizeof(real_t) * N);
+  }
+  scratch_put(scratch, a);
+}
+
 void fc_forward(fc_layer_t* l, vol_t** in, vol_t** out, int start, int end) {
-  for (int j = start; j <= end; j++) {
-    vol_t* V = in[j];
-    vol_t* A = out[j];
-        
-    for(int i=0;i<l->out_depth;i++) {
-      double a = 0.0;
-      for(int d=0;d<l->num_inputs;d++) {
-        a += V->w[d] * l->filters[i]->w[d];
-      }
-      a += l->biases->w[i];
-      A->w[i] = a;
-    }
+  fc_forward_scratch(l, in, out, start, end, NULL);
+}
+
+/*
+ * Release the packed weights and biases (see fc_pack), unless they belong
+ * to a snapshot mapping (see snapshot_load).
+ */
+
+void fc_free_packed(fc_layer_t* l) {
+  if (!l->packed_mapped) {
+    _mm_free(l->packed);
+    _mm_free(l->packed_bias);
   }
+  l->packed = NULL;
+  l->packed_bias = NULL;
+  l->packed_mapped = 0;
+}
+
+/*
+ * Pack the weights (one filter per output) and biases for gemm. This is done
+ * once after they have been loaded.
+ */
+
+void fc_pack(fc_layer_t* l) {
+  real_t* cols[l->out_depth];
+  for (int i = 0; i < l->out_depth; i++)
+    cols[i] = l->filters[i]->w;
+
+  fc_free_packed(l);
+  l->packed = gemm_pack_b(cols, l->num_inputs, l->out_depth);
+  l->packed_bias = gemm_pack_bias(l->biases->w, l->out_depth);
 }
 
 void fc_load(fc_layer_t* l, const char* fn) {
@@ -604,6 +797,8 @@ void fc_load(fc_layer_t* l, const char* fn) {
   }
 
   fclose(fin);
+
+  fc_pack(l);
 }
 
 // Softmax Layer --------------------------------------------------------------
@@ -616,7 +811,7 @@ typedef struct softmax_layer {
   int in_depth;
   int in_sx;
   int in_sy;
-  double* es; 
+  real_t* es; 
 
   // computed
   int out_depth;
@@ -637,28 +832,28 @@ softmax_layer_t* make_softmax_layer(int in_sx, int in_sy, int in_depth) {
   l->out_sy = 1;
   l->out_depth = l->in_sx * l->in_sy * l->in_depth;
 
-  l->es = (double*)malloc(sizeof(double)*l->out_depth);
+  l->es = (real_t*)malloc(sizeof(real_t)*l->out_depth);
 
   return l;
 }
 
 void softmax_forward(softmax_layer_t* l, vol_t** in, vol_t** out, int start, int end) {
-  double es[MAX_ES];
+  real_t es[MAX_ES];
 
   for (int j = start; j <= end; j++) {
     vol_t* V = in[j];
     vol_t* A = out[j];
   
     // compute max activation
-    double amax = V->w[0];
+    real_t amax = V->w[0];
     for(int i=1;i<l->out_depth;i++) {
       if(V->w[i] > amax) amax = V->w[i];
     }
   
     // compute exponentials (carefully to not blow up)
-    double esum = 0.0;
+    real_t esum = 0.0;
     for(int i=0;i<l->out_depth;i++) {
-      double e = exp(V->w[i] - amax);
+      real_t e = exp(V->w[i] - amax);
       esum += e;
       es[i] = e;
     }
@@ -681,7 +876,40 @@ void softmax_forward(softmax_layer_t* l, vol_t** in, vol_t** out, int start, int
 
 #define LAYERS 11
 
+/*
+ * A memory plan maps every volume of a batch to a buffer ("slot"). Volumes
+ * whose lifetimes don't overlap can share a slot (see plan_memory).
+ */
+
+typedef struct mem_plan {
+  int num_slots;
+  int slot[LAYERS+1];            // slot of every volume
+  uint64_t slot_size[LAYERS+1];  // number of real_ts in every slot
+} mem_plan_t;
+
+struct workspace;
+
+/*
+ * Flags for make_network.
+ *
+ * NET_FUSED: run every conv/relu/pool triple as one fused sweep
+ * (conv_relu_pool_forward). The conv and relu outputs (volumes 1, 2, 4, 5,
+ * 7 and 8) are then never written; use an unfused network to inspect them.
+ *
+ * NET_HALO: give the input volume of every conv layer a zero halo as wide as
+ * the conv padding (see vol_layout). The layer producing the volume writes
+ * into its interior, and the conv im2col copies filter rows without any
+ * bounds checks.
+ */
+
+#define NET_FUSED 1
+#define NET_HALO 2
+
+// Number of images net_classify_cats runs through net_forward at once.
+#define DEFAULT_BATCH_SIZE 8
+
 typedef struct network {
+  int flags;
   vol_t* v[LAYERS+1];
   conv_layer_t* l0;
   relu_layer_t* l1;
@@ -694,14 +922,31 @@ typedef struct network {
   pool_layer_t* l8;
   fc_layer_t* l9;
   softmax_layer_t* l10;
+
+  // memory plan used for batches (see plan_memory)
+  mem_plan_t plan;
+
+  // per-thread workspaces (see net_reserve_workspaces), each holding
+  // batch_size images
+  int batch_size;
+  int num_ws;
+  struct workspace* ws;
+
+  // mapped binary snapshot the weights were loaded from, or NULL (see
+  // snapshot_load)
+  void* snapshot;
+  size_t snapshot_size;
 } network_t;
 
+void plan_memory(network_t* net, int keep_all, mem_plan_t* plan);
+
 /*
  * Instantiate our specific CNN.
  */
 
-network_t* make_network() {
+network_t* make_network(int flags) {
   network_t* net = (network_t*)malloc(sizeof(network_t));
+  net->flags = flags;
   net->v[0] = make_vol(32, 32, 3, 0.0);
   net->l0 = make_conv_layer(32, 32, 3, 5, 16, 1, 2);
   net->v[1] = make_vol(net->l0->out_sx, net->l0->out_sy, net->l0->out_depth, 0.0);
@@ -725,6 +970,24 @@ network_t* make_network() {
   net->v[10] = make_vol(net->l9->out_sx, net->l9->out_sy, net->l9->out_depth, 0.0);
   net->l10 = make_softmax_layer(net->v[10]->sx, net->v[10]->sy, net->v[10]->depth);
   net->v[11] = make_vol(net->l10->out_sx, net->l10->out_sy, net->l10->out_depth, 0.0);
+  net->batch_size = DEFAULT_BATCH_SIZE;
+  net->num_ws = 0;
+  net->ws = NULL;
+  net->snapshot = NULL;
+  net->snapshot_size = 0;
+  init_pixel_norm();
+  if (!can_fuse(net->l0, net->l2) || !can_fuse(net->l3, net->l5) || !can_fuse(net->l6, net->l8))
+    net->flags &= ~NET_FUSED;
+
+  if (flags & NET_HALO) {
+    conv_layer_t* convs[3] = { net->l0, net->l3, net->l6 };
+    for (int c = 0; c < 3; c++) {
+      vol_t* v = net->v[3*c];
+      net->v[3*c] = make_vol_padded(v->sx, v->sy, v->depth, convs[c]->pad, 0.0);
+      free_vol(v);
+    }
+  }
+  plan_memory(net, 0, &net->plan);
   return net;
 }
 
@@ -732,10 +995,19 @@ network_t* make_network() {
  * Free our specific CNN.
  */
 
+void net_free_workspaces(network_t* net);
+
 void free_network(network_t* net) {
   for (int i = 0; i < LAYERS+1; i++)
     free_vol(net->v[i]);
 
+  net_free_workspaces(net);
+
+  conv_free_packed(net->l0);
+  conv_free_packed(net->l3);
+  conv_free_packed(net->l6);
+  fc_free_packed(net->l9);
+
   free(net->l0);
   free(net->l1);
   free(net->l2);
@@ -748,9 +1020,100 @@ void free_network(network_t* net) {
   free(net->l9);
   free(net->l10);
 
+  if (net->snapshot != NULL)
+    munmap(net->snapshot, net->snapshot_size);
+
   free(net);
 }
 
+// Memory Planning ------------------------------------------------------------
+
+/*
+ * Layer i of net_forward reads volume i and writes volume i+1, so volume i
+ * is live from layer i-1 to layer i (and the last volume until the caller
+ * has read the result). At any moment only two adjacent volumes are live.
+ *
+ * plan_memory assigns the volumes to slots by a linear scan over their
+ * lifetimes: a volume reuses a slot whose last reader ran before the layer
+ * that writes it, preferring the smallest slot that is large enough. Layers
+ * in layer_in_place (relu) may write straight over their input, so their
+ * output shares the input's slot. For our network this leaves two slots.
+ * Volumes that a fused network never writes get no slot (and w = NULL).
+ * Volumes with a halo always get a slot of their own, so that their zero
+ * border is never overwritten by another volume.
+ *
+ * With keep_all, every volume gets its own slot instead, so all of them can
+ * be inspected after net_forward (e.g., for the layer dumps of do_test).
+ */
+
+static const int layer_in_place[LAYERS] = { 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 0 };
+
+/*
+ * Whether volume i is written at all (fused networks skip the conv and relu
+ * outputs of every stage).
+ */
+
+static int net_materializes(network_t* net, int i) {
+  return !(net->flags & NET_FUSED) || (i % 3 == 0 || i > 9);
+}
+
+void plan_memory(network_t* net, int keep_all, mem_plan_t* plan) {
+  int owner[LAYERS+1];
+  int prev = -1;
+  plan->num_slots = 0;
+
+  for (int i = 0; i < LAYERS+1; i++) {
+    vol_t* v = net->v[i];
+    uint64_t size = (v->sy + 2 * v->pad) * v->ystride;
+    int s = -1;
+
+    if (!net_materializes(net, i)) {
+      plan->slot[i] = -1;
+      continue;
+    }
+
+    if (!keep_all && i > 0 && prev == i-1 && layer_in_place[i-1] && v->pad == 0) {
+      s = plan->slot[i-1];
+    } else if (!keep_all && v->pad == 0) {
+      // Volume owner[t] was last read by the step that reads it, so the slot
+      // is free if that step runs before the one that reads volume prev and
+      // produces volume i.
+      for (int t = 0; t < plan->num_slots; t++) {
+        if (owner[t] >= prev || net->v[owner[t]]->pad > 0)
+          continue;
+        int fits_t = plan->slot_size[t] >= size;
+        int fits_s = s >= 0 && plan->slot_size[s] >= size;
+        if (s < 0 || (fits_t && !fits_s) ||
+            (fits_t && plan->slot_size[t] < plan->slot_size[s]) ||
+            (!fits_t && !fits_s && plan->slot_size[t] > plan->slot_size[s]))
+          s = t;
+      }
+    }
+
+    if (s < 0) {
+      s = plan->num_slots++;
+      plan->slot_size[s] = 0;
+    }
+    if (plan->slot_size[s] < size)
+      plan->slot_size[s] = size;
+    owner[s] = i;
+    plan->slot[i] = s;
+    prev = i;
+  }
+}
+
+/*
+ * Number of real_ts needed per image by a plan. Every slot starts on a 64
+ * byte boundary.
+ */
+
+uint64_t plan_size(mem_plan_t* plan) {
+  uint64_t total = 0;
+  for (int s = 0; s < plan->num_slots; s++)
+    total += (plan->slot_size[s] + VOL_ALIGN - 1) & ~(VOL_ALIGN - 1);
+  return total;
+}
+
 /*
  * We organize data as "batches" of volumes. Each batch consists of a number of samples,
  * each of which contains a volume for every intermediate layer. Say we have L layers
@@ -759,63 +1122,311 @@ void free_network(network_t* net) {
  *
  * By using batches, we can process multiple images at once in each run of the forward
  * functions of the different layers.
+ *
+ * The memory of the volumes of each image is laid out according to a memory plan, so
+ * volumes may share memory. The slots of one image are allocated as a single block,
+ * which starts with the slot of the input volume.
  */
 
 typedef vol_t** batch_t;
 
 /*
- * This function allocates a new batch for the network old_net with size images.
+ * This function allocates a new batch for the network net with size images,
+ * using the given memory plan.
  */
 
-batch_t* make_batch(network_t* old_net, int size) {
+batch_t* make_batch_plan(network_t* net, int size, mem_plan_t* plan) {
+  uint64_t offset[LAYERS+1];
+  offset[0] = 0;
+  for (int s = 1; s < plan->num_slots; s++)
+    offset[s] = offset[s-1] + ((plan->slot_size[s-1] + VOL_ALIGN - 1) & ~(VOL_ALIGN - 1));
+
+  real_t** mem = (real_t**)malloc(sizeof(real_t*)*size);
+  for (int j = 0; j < size; j++) {
+    mem[j] = (real_t*)_mm_malloc(sizeof(real_t)*plan_size(plan), 64);
+    memset(mem[j], 0, sizeof(real_t)*plan_size(plan));
+  }
+
   batch_t* out = (batch_t*)malloc(sizeof(vol_t**)*(LAYERS+1));
   for (int i = 0; i < LAYERS+1; i++) {
     out[i] = (vol_t**)malloc(sizeof(vol_t*)*size);
     for (int j = 0; j < size; j++) {
-      out[i][j] = make_vol(old_net->v[i]->sx, old_net->v[i]->sy, old_net->v[i]->depth, 0.0);
+      out[i][j] = (vol_t*)malloc(sizeof(vol_t));
+      *out[i][j] = *net->v[i];
+      out[i][j]->w = (plan->slot[i] < 0) ? NULL :
+                     mem[j] + offset[plan->slot[i]] + net->v[i]->offset;
     }
   }
 
+  assert(plan->slot[0] == 0);
+  free(mem);
   return out;
 }
 
+/*
+ * This function allocates a new batch for the network old_net with size images,
+ * using the memory plan of the network.
+ */
+
+batch_t* make_batch(network_t* old_net, int size) {
+  return make_batch_plan(old_net, size, &old_net->plan);
+}
+
 /*
  * Free a previously allocated batch.
  */
 
 void free_batch(batch_t* v, int size) {
+  for (int j = 0; j < size; j++)
+    _mm_free(v[0][j]->w - v[0][j]->offset);
+
   for (int i = 0 ; i < LAYERS+1 ; i++) {
     for (int j = 0; j < size; j++) {
-      free_vol(v[i][j]);
+      free(v[i][j]);
     }
     free(v[i]);
 }
   free(v);
 
 }
+
+// Workspaces -----------------------------------------------------------------
+
+/*
+ * A workspace holds everything one thread needs to run the network: a batch
+ * of activation volumes for size images (net->batch_size), and the scratch
+ * memory of the kernels (see scratch_get). The network keeps one workspace
+ * per worker thread. They are allocated once and reused for every image the
+ * thread processes, so classification never touches the allocator.
+ */
+
+typedef struct workspace {
+  int size;
+  batch_t* batch;
+  real_t* scratch;
+} workspace_t;
+
+// Scratch values for any layer of net, fused or not.
+static size_t net_scratch_size(network_t* net) {
+  conv_layer_t* conv[3] = { net->l0, net->l3, net->l6 };
+  pool_layer_t* pool[3] = { net->l2, net->l5, net->l8 };
+  size_t size = fc_scratch_size(net->l9);
+  for (int c = 0; c < 3; c++) {
+    if (conv_scratch_size(conv[c]) > size)
+      size = conv_scratch_size(conv[c]);
+    if (can_fuse(conv[c], pool[c]) && conv_relu_pool_scratch_size(conv[c], pool[c]) > size)
+      size = conv_relu_pool_scratch_size(conv[c], pool[c]);
+  }
+  return size;
+}
+
+void net_free_workspaces(network_t* net) {
+  for (int i = 0; i < net->num_ws; i++) {
+    free_batch(net->ws[i].batch, net->ws[i].size);
+    _mm_free(net->ws[i].scratch);
+  }
+  free(net->ws);
+  net->ws = NULL;
+  net->num_ws = 0;
+}
+
+/*
+ * Make sure net has at least n workspaces. This must not be called while
+ * other threads are using the workspaces of net.
+ */
+
+void net_reserve_workspaces(network_t* net, int n) {
+  // Workspaces of a different batch size are thrown away.
+  if (net->num_ws > 0 && net->ws[0].size != net->batch_size)
+    net_free_workspaces(net);
+  if (n <= net->num_ws)
+    return;
+
+  net->ws = (workspace_t*)realloc(net->ws, sizeof(workspace_t)*n);
+  for (int i = net->num_ws; i < n; i++) {
+    net->ws[i].size = net->batch_size;
+    net->ws[i].batch = make_batch(net, net->batch_size);
+    net->ws[i].scratch = (real_t*)_mm_malloc(sizeof(real_t) * net_scratch_size(net), 64);
+  }
+  net->num_ws = n;
+}
+
+/*
+ * Return the workspace of thread t (t < net->num_ws).
+ */
+
+static inline workspace_t* net_workspace(network_t* net, int t) {
+  return &net->ws[t];
+}
+
+/*
+ * Return the kernel scratch of thread t, or NULL if it has no workspace
+ * (t is -1 outside of the workers).
+ */
+
+static inline real_t* net_scratch(network_t* net, int t) {
+  return (t >= 0 && t < net->num_ws) ? net->ws[t].scratch : NULL;
+}
+
 /*
  * Apply our network to a specific batch of inputs. The batch has to be given
  * as input to v and start/end are the first and the last image in that batch
- * to process (start and end are inclusive).
+ * to process (start and end are inclusive). Every layer is timed while a
+ * profile is active (see profile.c) and traced while tracing is on (see
+ * trace.c); a fused stage counts as its conv layer.
  */
 
 void net_forward(network_t* net, batch_t* v, int start, int end) {
-  conv_forward(net->l0, v[0], v[1], start, end);
-  relu_forward(net->l1, v[1], v[2], start, end);
-  pool_forward(net->l2, v[2], v[3], start, end);
-  conv_forward(net->l3, v[3], v[4], start, end);
-  relu_forward(net->l4, v[4], v[5], start, end);
-  pool_forward(net->l5, v[5], v[6], start, end);
-  conv_forward(net->l6, v[6], v[7], start, end);
-  relu_forward(net->l7, v[7], v[8], start, end);
-  pool_forward(net->l8, v[8], v[9], start, end);
-  fc_forward(net->l9, v[9], v[10], start, end);
-  softmax_forward(net->l10, v[10], v[11], start, end);
+  int n = end - start + 1;
+  real_t* s = net_scratch(net, sched_worker_id());
+  if (net->flags & NET_FUSED) {
+    PROFILE(0, n, conv_relu_pool_rows(net->l0, net->l2, v[0], v[3], start, end, 0,
+                                      net->l2->out_sy, s));
+    PROFILE(3, n, conv_relu_pool_rows(net->l3, net->l5, v[3], v[6], start, end, 0,
+                                      net->l5->out_sy, s));
+    PROFILE(6, n, conv_relu_pool_rows(net->l6, net->l8, v[6], v[9], start, end, 0,
+                                      net->l8->out_sy, s));
+    PROFILE(9, n, fc_forward_scratch(net->l9, v[9], v[10], start, end, s));
+    PROFILE(10, n, softmax_forward(net->l10, v[10], v[11], start, end));
+    return;
+  }
+
+  PROFILE(0, n, conv_forward_rows(net->l0, v[0], v[1], start, end, 0, net->l0->out_sy, s));
+  PROFILE(1, n, relu_forward(net->l1, v[1], v[2], start, end));
+  PROFILE(2, n, pool_forward(net->l2, v[2], v[3], start, end));
+  PROFILE(3, n, conv_forward_rows(net->l3, v[3], v[4], start, end, 0, net->l3->out_sy, s));
+  PROFILE(4, n, relu_forward(net->l4, v[4], v[5], start, end));
+  PROFILE(5, n, pool_forward(net->l5, v[5], v[6], start, end));
+  PROFILE(6, n, conv_forward_rows(net->l6, v[6], v[7], start, end, 0, net->l6->out_sy, s));
+  PROFILE(7, n, relu_forward(net->l7, v[7], v[8], start, end));
+  PROFILE(8, n, pool_forward(net->l8, v[8], v[9], start, end));
+  PROFILE(9, n, fc_forward_scratch(net->l9, v[9], v[10], start, end, s));
+  PROFILE(10, n, softmax_forward(net->l10, v[10], v[11], start, end));
+}
+
+/*
+ * One step of net_forward_parallel: layer i (or, in a fused network, the
+ * conv/relu/pool stage starting at layer i), split into output rows.
+ */
+
+typedef struct layer_job {
+  network_t* net;
+  batch_t* v;
+  int i;
+  int start, end;
+} layer_job_t;
+
+static int layer_rows(network_t* net, int i) {
+  if (net->flags & NET_FUSED)
+    return net->v[i+3]->sy;
+  return net->v[i+1]->sy;
+}
+
+static void layer_row(void* ctx, int y, int worker) {
+  layer_job_t* job = (layer_job_t*)ctx;
+  network_t* net = job->net;
+  batch_t* v = job->v;
+  int i = job->i;
+  conv_layer_t* conv[3] = { net->l0, net->l3, net->l6 };
+  relu_layer_t* relu[3] = { net->l1, net->l4, net->l7 };
+  pool_layer_t* pool[3] = { net->l2, net->l5, net->l8 };
+
+  real_t* s = net_scratch(net, worker);
+
+  if (net->flags & NET_FUSED)
+    conv_relu_pool_rows(conv[i/3], pool[i/3], v[i], v[i+3], job->start, job->end, y, y+1, s);
+  else if (i % 3 == 0)
+    conv_forward_rows(conv[i/3], v[i], v[i+1], job->start, job->end, y, y+1, s);
+  else if (i % 3 == 1)
+    relu_forward_rows(relu[i/3], v[i], v[i+1], job->start, job->end, y, y+1);
+  else
+    pool_forward_rows(pool[i/3], v[i], v[i+1], job->start, job->end, y, y+1);
+}
+
+/*
+ * Same as net_forward, but every conv, relu and pool layer is split into
+ * one task per output row, which the workers of the scheduler share. This
+ * cuts the latency of a single image to a fraction of what one core takes.
+ * It costs a synchronization per layer and smaller gemm calls, so for many
+ * images it is faster to give every worker images of its own (see
+ * net_split_images). The fc and softmax layers are too small to split.
+ */
+
+void net_forward_parallel(network_t* net, batch_t* v, int start, int end) {
+  int n = end - start + 1;
+  int step = (net->flags & NET_FUSED) ? 3 : 1;
+  for (int i = 0; i < 9; i += step) {
+    layer_job_t job = { net, v, i, start, end };
+    PROFILE(i, n, sched_parallel_for(layer_rows(net, i), 1, layer_row, &job));
+  }
+  PROFILE(9, n, fc_forward_scratch(net->l9, v[9], v[10], start, end,
+                                   net_scratch(net, sched_worker_id())));
+  PROFILE(10, n, softmax_forward(net->l10, v[10], v[11], start, end));
+}
+
+/*
+ * Cost model of layer i for the profiler: FLOPs (a multiply-add counts as
+ * two, a compare or exp as one) and bytes of activations per image, and
+ * bytes of parameters per call. In a fused network the whole stage counts
+ * as its conv layer, without the activations in between, which stay in
+ * cache.
+ */
+
+static const char* const layer_type[LAYERS] = {
+  "conv", "relu", "pool", "conv", "relu", "pool", "conv", "relu", "pool", "fc", "softmax"
+};
+
+static double vol_size(vol_t* v) {
+  return (double)v->sx * v->sy * v->depth;
+}
+
+void net_layer_cost(network_t* net, int i, double* flops, double* act_bytes,
+                    double* param_bytes) {
+  conv_layer_t* conv[3] = { net->l0, net->l3, net->l6 };
+  pool_layer_t* pool[3] = { net->l2, net->l5, net->l8 };
+  int fused = (net->flags & NET_FUSED) && i < 9;
+  *flops = 0.0;
+  *act_bytes = 0.0;
+  *param_bytes = 0.0;
+
+  if (fused && i % 3 != 0)
+    return;
+  for (int j = i; j <= (fused ? i + 2 : i); j++) {
+    vol_t* out = net->v[j+1];
+    if (j < 9 && j % 3 == 0) {
+      conv_layer_t* l = conv[j/3];
+      double k = l->sx * l->sy * l->in_depth;
+      *flops += 2.0 * k * vol_size(out);
+      *param_bytes += sizeof(real_t) * (k + 1) * l->out_depth;
+    } else if (j < 9 && j % 3 == 1) {
+      *flops += vol_size(out);
+    } else if (j < 9) {
+      *flops += vol_size(out) * pool[j/3]->sx * pool[j/3]->sy;
+    } else if (j == 9) {
+      *flops += 2.0 * net->l9->num_inputs * net->l9->out_depth;
+      *param_bytes += sizeof(real_t) * (net->l9->num_inputs + 1) * net->l9->out_depth;
+    } else {
+      *flops += 3.0 * vol_size(out);
+    }
+  }
+  *act_bytes = sizeof(real_t) * (vol_size(net->v[i]) + vol_size(net->v[fused ? i+3 : i+1]));
+}
+
+/*
+ * Whether n images should be classified with net_forward_parallel. Spreading
+ * whole batches over the workers has the best throughput, but leaves workers
+ * idle when there are fewer batches than workers, as for the one to a few
+ * images of an interactive request. Then the images are split instead.
+ */
+
+int net_split_images(network_t* net, int n) {
+  int batches = (n + net->batch_size - 1) / net->batch_size;
+  return batches < sched_num_workers();
 }
 
 /*
  * Putting everything together: Take a set of n input images as 3-dimensional
- * Volumes and process them using the CNN in batches of 1. Then look at the
+ * Volumes and process them using the CNN in batches of net->batch_size. Then look at the
  * output (which is a set of 10 labels, each of which tells us the likelihood
  * of a specific category) and classify the image as a cat iff the likelihood
  * of "cat" is larger than 50%. Writes the cat likelihood for all images into
@@ -823,16 +1434,74 @@ void net_forward(network_t* net, batch_t* v, int start, int end) {
  */
 
 #define CAT_LABEL 3
-void net_classify_cats(network_t* net, vol_t** input, double* output, int n) {
- #pragma omp parallel for
-  for (int i = 0 ; i < n ; i++) {
-    batch_t* batch = make_batch(net, 1);
-    copy_vol(batch[0][0], input[i]);
-    net_forward(net, batch, 0, 0);
-    output[i] = batch[11][0]->w[CAT_LABEL]; 
-    free_batch(batch, 1);
+
+/*
+ * The batches of a classification, which are scheduled as one task each.
+ * Every worker runs its batches in its own workspace.
+ */
+
+typedef struct classify_job {
+  network_t* net;
+  vol_t** vols;             // the input as volumes, or
+  const uint8_t** images;   // as raw images (see image_to_vol)
+  double* output;
+  int n;
+  int split;                // see net_split_images
+  uint64_t* done;           // when each image was done (timestamp_ns), or NULL
+} classify_job_t;
+
+static void classify_batch(void* ctx, int b, int worker) {
+  classify_job_t* job = (classify_job_t*)ctx;
+  network_t* net = job->net;
+  batch_t* batch = net_workspace(net, worker)->batch;
+  int bs = net->batch_size;
+  int first = b * bs;
+  int count = (job->n - first < bs) ? job->n - first : bs;
+  uint64_t t0 = trace_begin();
+
+  for (int j = 0; j < count; j++) {
+    if (job->images != NULL)
+      image_to_vol(batch[0][j], job->images[first + j]);
+    else
+      copy_vol(batch[0][j], job->vols[first + j]);
   }
+  if (job->split)
+    net_forward_parallel(net, batch, 0, count - 1);
+  else
+    net_forward(net, batch, 0, count - 1);
+  for (int j = 0; j < count; j++)
+    job->output[first + j] = batch[11][j]->w[CAT_LABEL];
+  if (job->done != NULL) {
+    uint64_t now = timestamp_ns();
+    for (int j = 0; j < count; j++)
+      job->done[first + j] = now;
+  }
+  trace_end("batch", -1, "first", first, t0);
+}
+
+void net_classify_cats(network_t* net, vol_t** input, double* output, int n) {
+  net_reserve_workspaces(net, sched_num_workers());
+  classify_job_t job = { net, input, NULL, output, n, net_split_images(net, n), NULL };
+  sched_parallel_for((n + net->batch_size - 1) / net->batch_size, 1, classify_batch, &job);
 }
+
+/*
+ * Same as net_classify_cats, for n raw images (see image_to_vol). If done is
+ * not NULL, the time each image was done (timestamp_ns) is written into it.
+ * Several threads may classify at once, once the workspaces are reserved.
+ */
+
+void net_classify_images_timed(network_t* net, const uint8_t** input, double* output, int n,
+                               uint64_t* done) {
+  net_reserve_workspaces(net, sched_num_workers());
+  classify_job_t job = { net, NULL, input, output, n, net_split_images(net, n), done };
+  sched_parallel_for((n + net->batch_size - 1) / net->batch_size, 1, classify_batch, &job);
+}
+
+void net_classify_images(network_t* net, const uint8_t** input, double* output, int n) {
+  net_classify_images_timed(net, input, output, n, NULL);
+}
+
 // IGNORE EVERYTHING BELOW THIS POINT -----------------------------------------
 
 // Including C files in other C files is very bad style and should be avoided
@@ -840,5 +1509,12 @@ void net_classify_cats(network_t* net, vol_t** input, double* output, int n) {
 // may edit to be in one file, without having to fix the interfaces between
 // the different components of the system.
 
+#include "pipeline.c"
+#include "batcher.c"
+#include "snapshot.c"
+#include "quant.c"
 #include "util.c"
+#include "verify.c"
+#ifndef CNN_NO_MAIN
 #include "main.c"
+#endif
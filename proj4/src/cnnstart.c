@@ -732,5 +732,7 @@ void net_classify_cats(network_t* net, vol_t** input, double* output, int n) {
 // may edit to be in one file, without having to fix the interfaces between
 // the different components of the system.
 
+#ifndef CNN_NO_MAIN
 #include "util.c"
 #include "main.c"
+#endif
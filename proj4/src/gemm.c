@@ -0,0 +1,64 @@
+// GEMM -----------------------------------------------------------------------
+
+/*
+ * A small cache-blocked matrix multiply used by the convolutional layers.
+ * It computes C = A * B + bias, where A is an m x k row-major matrix (the
+ * im2col patches, one row per output pixel), B is a k x n matrix of filter
+ * weights that has been packed once with gemm_pack_b, and C is the m x n
+ * row-major output (one row per output pixel, one column per filter), which
+ * is exactly the memory layout of a vol_t.
+ *
+ * The work is split into GEMM_MR x GEMM_NR register tiles (one vector per
+ * row). A tile of C stays in registers for a whole GEMM_KC deep slice of k,
+ * so every packed B panel is read from L1 and every A value is loaded
+ * exactly once per tile. The kernels themselves are in kernels.c, which is
+ * compiled once per instruction set (see isa.c). GEMM_NR is the vector
+ * length of the kernels selected at startup, so the packed layout is only
+ * known at runtime.
+ */
+
+#define GEMM_MR 8
+#define GEMM_NR gemm_nr()
+#define GEMM_KC 128
+#define GEMM_MC 32
+
+static int gemm_nr(void);
+
+/*
+ * Number of real_ts needed to hold a packed k x n matrix (n is rounded up
+ * to a whole number of GEMM_NR wide panels).
+ */
+
+static inline int gemm_packed_size(int k, int n) {
+  return ((n + GEMM_NR - 1) / GEMM_NR) * GEMM_NR * k;
+}
+
+/*
+ * Pack B into panels of GEMM_NR columns. Inside a panel the values are
+ * stored k-major, so the microkernel reads one aligned vector (of up to 64
+ * bytes) per k. Column j of B is given as cols[j][0..k), i.e. one filter per
+ * column. Columns past n are padded with zeros.
+ */
+
+static real_t* gemm_pack_b(real_t** cols, int k, int n) {
+  real_t* bp = (real_t*)_mm_malloc(sizeof(real_t)*gemm_packed_size(k, n), 64);
+  int nr = GEMM_NR;
+  for (int j = 0; j < gemm_packed_size(k, n) / k; j++) {
+    real_t* panel = bp + (j / nr) * k * nr + (j % nr);
+    for (int p = 0; p < k; p++)
+      panel[p * nr] = (j < n) ? cols[j][p] : 0.0;
+  }
+  return bp;
+}
+
+/*
+ * Pack a bias vector the same way (padded to a whole panel).
+ */
+
+static real_t* gemm_pack_bias(real_t* bias, int n) {
+  int np = gemm_packed_size(1, n);
+  real_t* out = (real_t*)_mm_malloc(sizeof(real_t)*np, 64);
+  for (int j = 0; j < np; j++)
+    out[j] = (j < n) ? bias[j] : 0.0;
+  return out;
+}
@@ -0,0 +1,215 @@
+// CPU Dispatch ---------------------------------------------------------------
+
+/*
+ * The kernels in kernels.c are compiled once for every instruction set below,
+ * and the best one the CPU supports is picked the first time a kernel is
+ * needed. The rest of the program is built for the x86-64 baseline (SSE2),
+ * so one binary runs on old hosts and still uses FMA or AVX-512 on new ones.
+ *
+ * Setting CNN_ISA to one of the variant names forces that variant, e.g.
+ * CNN_ISA=scalar runs the plain C reference kernels (built without
+ * auto-vectorization) to compare the vector code against.
+ *
+ * The vector length of the variant is also the panel width of the packed
+ * weights (GEMM_NR), so the variant is fixed once the first layer is loaded.
+ */
+
+enum { ISA_SCALAR, ISA_SSE2, ISA_AVX, ISA_AVX2, ISA_AVX512, ISA_COUNT };
+
+typedef struct cnn_kernels {
+  const char* name;
+  int level;
+  int nr;
+
+  void (*gemm)(int m, int n, int k, const real_t* a, int lda,
+               const real_t* bp, const real_t* bias, real_t* c, int ldc);
+  void (*relu)(real_t* out, const real_t* in, int n);
+  void (*vmax)(real_t* dst, const real_t* src, int n);
+  real_t (*peak)(long n);
+} cnn_kernels_t;
+
+#define KERNEL(name) KERNEL_(name, KERNEL_ISA)
+#define KERNEL_(name, isa) KERNEL__(name, isa)
+#define KERNEL__(name, isa) name##_##isa
+
+// Plain C, one value per "vector".
+#pragma GCC push_options
+#pragma GCC optimize("no-tree-vectorize")
+#define KERNEL_ISA scalar
+#define KERNEL_NAME "scalar"
+#define KERNEL_LEVEL ISA_SCALAR
+#define vreal_t real_t
+#define VREAL_LEN 1
+#define vreal_load(p) (*(p))
+#define vreal_loadu(p) (*(p))
+#define vreal_storeu(p, v) (*(p) = (v))
+#define vreal_broadcast(p) (*(p))
+#define vreal_madd(c, a, b) ((c) + (a) * (b))
+#include "kernels.c"
+#pragma GCC pop_options
+
+// SSE2, 16 byte vectors.
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#define KERNEL_ISA sse2
+#define KERNEL_NAME "sse2"
+#define KERNEL_LEVEL ISA_SSE2
+#ifdef CNN_FLOAT
+#define vreal_t __m128
+#define VREAL_LEN 4
+#define vreal_load(p) _mm_load_ps(p)
+#define vreal_loadu(p) _mm_loadu_ps(p)
+#define vreal_storeu(p, v) _mm_storeu_ps(p, v)
+#define vreal_broadcast(p) _mm_load1_ps(p)
+#define vreal_madd(c, a, b) _mm_add_ps(c, _mm_mul_ps(a, b))
+#else
+#define vreal_t __m128d
+#define VREAL_LEN 2
+#define vreal_load(p) _mm_load_pd(p)
+#define vreal_loadu(p) _mm_loadu_pd(p)
+#define vreal_storeu(p, v) _mm_storeu_pd(p, v)
+#define vreal_broadcast(p) _mm_load1_pd(p)
+#define vreal_madd(c, a, b) _mm_add_pd(c, _mm_mul_pd(a, b))
+#endif
+#include "kernels.c"
+#pragma GCC pop_options
+
+// AVX, 32 byte vectors.
+#pragma GCC push_options
+#pragma GCC target("avx")
+#define KERNEL_ISA avx
+#define KERNEL_NAME "avx"
+#define KERNEL_LEVEL ISA_AVX
+#ifdef CNN_FLOAT
+#define vreal_t __m256
+#define VREAL_LEN 8
+#define vreal_load(p) _mm256_load_ps(p)
+#define vreal_loadu(p) _mm256_loadu_ps(p)
+#define vreal_storeu(p, v) _mm256_storeu_ps(p, v)
+#define vreal_broadcast(p) _mm256_broadcast_ss(p)
+#define vreal_madd(c, a, b) _mm256_add_ps(c, _mm256_mul_ps(a, b))
+#else
+#define vreal_t __m256d
+#define VREAL_LEN 4
+#define vreal_load(p) _mm256_load_pd(p)
+#define vreal_loadu(p) _mm256_loadu_pd(p)
+#define vreal_storeu(p, v) _mm256_storeu_pd(p, v)
+#define vreal_broadcast(p) _mm256_broadcast_sd(p)
+#define vreal_madd(c, a, b) _mm256_add_pd(c, _mm256_mul_pd(a, b))
+#endif
+#include "kernels.c"
+#pragma GCC pop_options
+
+// AVX2 with fused multiply-add, 32 byte vectors.
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#define KERNEL_ISA avx2
+#define KERNEL_NAME "avx2"
+#define KERNEL_LEVEL ISA_AVX2
+#ifdef CNN_FLOAT
+#define vreal_t __m256
+#define VREAL_LEN 8
+#define vreal_load(p) _mm256_load_ps(p)
+#define vreal_loadu(p) _mm256_loadu_ps(p)
+#define vreal_storeu(p, v) _mm256_storeu_ps(p, v)
+#define vreal_broadcast(p) _mm256_broadcast_ss(p)
+#define vreal_madd(c, a, b) _mm256_fmadd_ps(a, b, c)
+#else
+#define vreal_t __m256d
+#define VREAL_LEN 4
+#define vreal_load(p) _mm256_load_pd(p)
+#define vreal_loadu(p) _mm256_loadu_pd(p)
+#define vreal_storeu(p, v) _mm256_storeu_pd(p, v)
+#define vreal_broadcast(p) _mm256_broadcast_sd(p)
+#define vreal_madd(c, a, b) _mm256_fmadd_pd(a, b, c)
+#endif
+#include "kernels.c"
+#pragma GCC pop_options
+
+// AVX-512F, 64 byte vectors.
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#define KERNEL_ISA avx512
+#define KERNEL_NAME "avx512"
+#define KERNEL_LEVEL ISA_AVX512
+#ifdef CNN_FLOAT
+#define vreal_t __m512
+#define VREAL_LEN 16
+#define vreal_load(p) _mm512_load_ps(p)
+#define vreal_loadu(p) _mm512_loadu_ps(p)
+#define vreal_storeu(p, v) _mm512_storeu_ps(p, v)
+#define vreal_broadcast(p) _mm512_set1_ps(*(p))
+#define vreal_madd(c, a, b) _mm512_fmadd_ps(a, b, c)
+#else
+#define vreal_t __m512d
+#define VREAL_LEN 8
+#define vreal_load(p) _mm512_load_pd(p)
+#define vreal_loadu(p) _mm512_loadu_pd(p)
+#define vreal_storeu(p, v) _mm512_storeu_pd(p, v)
+#define vreal_broadcast(p) _mm512_set1_pd(*(p))
+#define vreal_madd(c, a, b) _mm512_fmadd_pd(a, b, c)
+#endif
+#include "kernels.c"
+#pragma GCC pop_options
+
+// Indexed by level.
+static const cnn_kernels_t* const cnn_variants[ISA_COUNT] = {
+  &kernels_scalar, &kernels_sse2, &kernels_avx, &kernels_avx2, &kernels_avx512
+};
+
+static const cnn_kernels_t* cnn_isa = NULL;
+
+/*
+ * The best variant the CPU (and OS) supports.
+ */
+
+static int cpu_isa_level(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return ISA_AVX512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return ISA_AVX2;
+  if (__builtin_cpu_supports("avx"))
+    return ISA_AVX;
+  if (__builtin_cpu_supports("sse2"))
+    return ISA_SSE2;
+  return ISA_SCALAR;
+}
+
+/*
+ * Returns the kernels to use, selecting them on the first call.
+ */
+
+static const cnn_kernels_t* cnn_kernels(void) {
+  if (cnn_isa != NULL)
+    return cnn_isa;
+
+  int level = cpu_isa_level();
+  const char* force = getenv("CNN_ISA");
+  if (force != NULL && *force != '\0') {
+    int i = 0;
+    while (i < ISA_COUNT && strcmp(cnn_variants[i]->name, force) != 0)
+      i++;
+    if (i == ISA_COUNT) {
+      fprintf(stderr, "ERROR: Unknown CNN_ISA %s (scalar, sse2, avx, avx2, avx512)\n", force);
+      exit(1);
+    }
+    if (i > level) {
+      fprintf(stderr, "ERROR: CNN_ISA %s is not supported by this CPU\n", force);
+      exit(1);
+    }
+    level = i;
+  }
+
+  cnn_isa = cnn_variants[level];
+  return cnn_isa;
+}
+
+static int gemm_nr(void) {
+  return cnn_kernels()->nr;
+}
+
+static inline void gemm(int m, int n, int k, const real_t* a, int lda,
+                        const real_t* bp, const real_t* bias, real_t* c, int ldc) {
+  cnn_kernels()->gemm(m, n, k, a, lda, bp, bias, c, ldc);
+}
@@ -0,0 +1,173 @@
+// Kernels --------------------------------------------------------------------
+
+/*
+ * The hot loops of the network, written once in terms of the vreal_ macros
+ * and compiled once per instruction set. isa.c defines the macros and
+ * KERNEL(name), which gives every function a per-variant name, and then
+ * includes this file, which ends with the cnn_kernels_t of the variant. The
+ * macros are undefined again at the end, so the next variant can define its
+ * own.
+ *
+ * The gemm kernels read B in panels of VREAL_LEN columns, which must match
+ * the GEMM_NR the weights were packed with (see gemm.c).
+ */
+
+/*
+ * Compute a full GEMM_MR x VREAL_LEN tile of C over kc values of k. If init
+ * is not NULL the tile starts out as the (packed) bias, otherwise the
+ * previous content of C is accumulated onto.
+ */
+
+static inline void KERNEL(gemm_kernel)(int kc, const real_t* a, int lda, const real_t* b,
+                                       real_t* c, int ldc, const real_t* init) {
+  vreal_t c0, c1, c2, c3, c4, c5, c6, c7;
+  if (init != NULL) {
+    c0 = vreal_load(init);
+    c1 = c0; c2 = c0; c3 = c0; c4 = c0; c5 = c0; c6 = c0; c7 = c0;
+  } else {
+    c0 = vreal_loadu(c + 0*ldc); c1 = vreal_loadu(c + 1*ldc);
+    c2 = vreal_loadu(c + 2*ldc); c3 = vreal_loadu(c + 3*ldc);
+    c4 = vreal_loadu(c + 4*ldc); c5 = vreal_loadu(c + 5*ldc);
+    c6 = vreal_loadu(c + 6*ldc); c7 = vreal_loadu(c + 7*ldc);
+  }
+
+  for (int p = 0; p < kc; p++) {
+    vreal_t bv = vreal_load(b + p*VREAL_LEN);
+    c0 = vreal_madd(c0, vreal_broadcast(a + 0*lda + p), bv);
+    c1 = vreal_madd(c1, vreal_broadcast(a + 1*lda + p), bv);
+    c2 = vreal_madd(c2, vreal_broadcast(a + 2*lda + p), bv);
+    c3 = vreal_madd(c3, vreal_broadcast(a + 3*lda + p), bv);
+    c4 = vreal_madd(c4, vreal_broadcast(a + 4*lda + p), bv);
+    c5 = vreal_madd(c5, vreal_broadcast(a + 5*lda + p), bv);
+    c6 = vreal_madd(c6, vreal_broadcast(a + 6*lda + p), bv);
+    c7 = vreal_madd(c7, vreal_broadcast(a + 7*lda + p), bv);
+  }
+
+  vreal_storeu(c + 0*ldc, c0); vreal_storeu(c + 1*ldc, c1);
+  vreal_storeu(c + 2*ldc, c2); vreal_storeu(c + 3*ldc, c3);
+  vreal_storeu(c + 4*ldc, c4); vreal_storeu(c + 5*ldc, c5);
+  vreal_storeu(c + 6*ldc, c6); vreal_storeu(c + 7*ldc, c7);
+}
+
+/*
+ * Full GEMM_MR rows, but only nr < VREAL_LEN columns at the right edge of C.
+ * Since B and the bias are padded with zeros, the tile is computed at full
+ * width in a temporary buffer and only the valid columns are copied back.
+ */
+
+static void KERNEL(gemm_kernel_cols)(int nr, int kc, const real_t* a, int lda, const real_t* b,
+                                     real_t* c, int ldc, const real_t* init) {
+  real_t tmp[GEMM_MR * VREAL_LEN];
+  if (init == NULL)
+    for (int i = 0; i < GEMM_MR; i++)
+      for (int j = 0; j < nr; j++)
+        tmp[i*VREAL_LEN + j] = c[i*ldc + j];
+  KERNEL(gemm_kernel)(kc, a, lda, b, tmp, VREAL_LEN, init);
+  for (int i = 0; i < GEMM_MR; i++)
+    for (int j = 0; j < nr; j++)
+      c[i*ldc + j] = tmp[i*VREAL_LEN + j];
+}
+
+/*
+ * Same as gemm_kernel, but for a partial tile of mr rows and nr columns at
+ * the bottom edge of C.
+ */
+
+static void KERNEL(gemm_kernel_edge)(int mr, int nr, int kc, const real_t* a, int lda,
+                                     const real_t* b, real_t* c, int ldc, const real_t* init) {
+  for (int i = 0; i < mr; i++)
+    for (int j = 0; j < nr; j++) {
+      real_t acc = (init != NULL) ? init[j] : c[i*ldc + j];
+      for (int p = 0; p < kc; p++)
+        acc += a[i*lda + p] * b[p*VREAL_LEN + j];
+      c[i*ldc + j] = acc;
+    }
+}
+
+/*
+ * C (m x n, leading dimension ldc) = A (m x k, leading dimension lda) * B + bias,
+ * with B and bias packed by gemm_pack_b and gemm_pack_bias.
+ */
+
+static void KERNEL(gemm)(int m, int n, int k, const real_t* a, int lda,
+                         const real_t* bp, const real_t* bias, real_t* c, int ldc) {
+  for (int pc = 0; pc < k; pc += GEMM_KC) {
+    int kc = (k - pc < GEMM_KC) ? k - pc : GEMM_KC;
+    for (int jc = 0; jc < n; jc += VREAL_LEN) {
+      int nr = (n - jc < VREAL_LEN) ? n - jc : VREAL_LEN;
+      const real_t* b = bp + jc * k + pc * VREAL_LEN;
+      const real_t* init = (pc == 0) ? bias + jc : NULL;
+      for (int ic = 0; ic < m; ic += GEMM_MR) {
+        int mr = (m - ic < GEMM_MR) ? m - ic : GEMM_MR;
+        if (mr == GEMM_MR && nr == VREAL_LEN)
+          KERNEL(gemm_kernel)(kc, a + ic*lda + pc, lda, b, c + ic*ldc + jc, ldc, init);
+        else if (mr == GEMM_MR)
+          KERNEL(gemm_kernel_cols)(nr, kc, a + ic*lda + pc, lda, b, c + ic*ldc + jc, ldc, init);
+        else
+          KERNEL(gemm_kernel_edge)(mr, nr, kc, a + ic*lda + pc, lda, b, c + ic*ldc + jc, ldc, init);
+      }
+    }
+  }
+}
+
+/*
+ * out[i] = max(in[i], 0) for n values. out may be the same as in.
+ */
+
+static void KERNEL(relu)(real_t* out, const real_t* in, int n) {
+  for (int i = 0; i < n; i++)
+    out[i] = (in[i] < 0.0) ? 0.0 : in[i];
+}
+
+/*
+ * dst[i] = max(dst[i], src[i]) for n values, i.e. one step of max pooling
+ * over a row of depth values.
+ */
+
+static void KERNEL(vmax)(real_t* restrict dst, const real_t* restrict src, int n) {
+  for (int i = 0; i < n; i++)
+    dst[i] = (src[i] > dst[i]) ? src[i] : dst[i];
+}
+
+/*
+ * n rounds of 8 independent vector multiply-adds, which keeps the FP units
+ * as busy as they get (the peak that cnn-bench measures, see bench.c).
+ * Returns a value depending on all results, so none of it can be skipped.
+ */
+
+static real_t KERNEL(peak)(long n) {
+  volatile real_t factors[2] = { 1.0, 1e-9 };  // unknown to the compiler
+  real_t one = factors[0], eps = factors[1];
+  vreal_t a = vreal_broadcast(&one), b = vreal_broadcast(&eps);
+  vreal_t c0 = b, c1 = b, c2 = b, c3 = b, c4 = b, c5 = b, c6 = b, c7 = b;
+  for (long i = 0; i < n; i++) {
+    c0 = vreal_madd(c0, a, b); c1 = vreal_madd(c1, a, b);
+    c2 = vreal_madd(c2, a, b); c3 = vreal_madd(c3, a, b);
+    c4 = vreal_madd(c4, a, b); c5 = vreal_madd(c5, a, b);
+    c6 = vreal_madd(c6, a, b); c7 = vreal_madd(c7, a, b);
+  }
+  real_t out[8 * VREAL_LEN];
+  vreal_storeu(out + 0*VREAL_LEN, c0); vreal_storeu(out + 1*VREAL_LEN, c1);
+  vreal_storeu(out + 2*VREAL_LEN, c2); vreal_storeu(out + 3*VREAL_LEN, c3);
+  vreal_storeu(out + 4*VREAL_LEN, c4); vreal_storeu(out + 5*VREAL_LEN, c5);
+  vreal_storeu(out + 6*VREAL_LEN, c6); vreal_storeu(out + 7*VREAL_LEN, c7);
+  real_t sum = 0.0;
+  for (int i = 0; i < 8 * VREAL_LEN; i++)
+    sum += out[i];
+  return sum;
+}
+
+static const cnn_kernels_t KERNEL(kernels) = {
+  KERNEL_NAME, KERNEL_LEVEL, VREAL_LEN, KERNEL(gemm), KERNEL(relu), KERNEL(vmax), KERNEL(peak)
+};
+
+#undef vreal_t
+#undef VREAL_LEN
+#undef vreal_load
+#undef vreal_loadu
+#undef vreal_storeu
+#undef vreal_broadcast
+#undef vreal_madd
+#undef KERNEL_ISA
+#undef KERNEL_NAME
+#undef KERNEL_LEVEL
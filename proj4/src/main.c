@@ -1,6 +1,15 @@
 // Default constants for test sizes.
 const int BENCHMARK_SIZE = 1200;
+const int SCALING_RUNS = 3;
+const double SCALING_MIN_EFFICIENCY = 0.75;
+const int LATENCY_REQUESTS = 2000;
+const int LATENCY_WARMUP = 50;
+const int LATENCY_BATCH_DELAY_US = 1000;
 const int PARTEST_SIZE = 1000;
+const int DUMP_SIZE = 100;
+const double VERIFY_TOLERANCE = 1e-11;
+const int VERIFY_MAX_REPORT = 10;
+const int QUANT_CALIB_SIZE = 500;
 
 /*
  * Run benchmark to determine Cat/s for a large data set.
@@ -14,6 +23,7 @@ int do_benchmark(int argc, char** argv) {
 
   fprintf(stderr, "\n          *** CS 61C, Spring 2017: Project 4 ***\n\n");
   fprintf(stderr, "RUNNING BENCHMARK ON %d PICTURES...\n", num_samples);
+  fprintf(stderr, "USING %s KERNELS ON %d WORKERS\n", cnn_kernels()->name, sched_num_workers());
 
   // Pick BENCHMARK_SIZE random samples, it doesn't matter which.
   int* samples = (int*)malloc(sizeof(int)*num_samples);
@@ -21,11 +31,301 @@ int do_benchmark(int argc, char** argv) {
     samples[i] = i;
   }
 
+  sched_reset_stats();
   double time = run_classification(samples, num_samples, NULL);
 
   free(samples);
 
   fprintf(stderr, "\nPERFORMANCE: %.2lf Cat/s\n\n", (1000.0 * (double)num_samples / time));
+  sched_print_stats(stderr);
+  fprintf(stderr, "\n");
+  return 0;
+}
+
+/*
+ * Sweep the benchmark workload over numbers of workers (powers of two up to
+ * all of them) and batch sizes. For every batch size, prints the Cat/s (best
+ * of SCALING_RUNS runs), the speedup over one worker and the parallel
+ * efficiency (speedup per worker). Rows where the efficiency first drops
+ * below SCALING_MIN_EFFICIENCY, or where more workers get less done, are
+ * flagged.
+ */
+
+int do_scaling(int argc, char** argv) {
+  int num_samples = (argc > 0) ? atoi(argv[0]) : BENCHMARK_SIZE;
+  int max_workers = (argc > 1) ? atoi(argv[1]) : sched_max_workers();
+  if (max_workers < 1 || max_workers > sched_max_workers())
+    max_workers = sched_max_workers();
+  static const int batch_sizes[] = { 1, 2, 4, 8, 16, 32 };
+
+  fprintf(stderr, "\nSCALING SWEEP ON %d PICTURES, UP TO %d WORKERS, %s KERNELS\n",
+          num_samples, max_workers, cnn_kernels()->name);
+
+  int* samples = (int*)malloc(sizeof(int)*num_samples);
+  for (int i = 0; i < num_samples; i++) {
+    samples[i] = i % 50000;
+  }
+  double* output = (double*)malloc(sizeof(double)*num_samples);
+  network_t* net = load_cnn_snapshot(NET_FUSED | NET_HALO);
+
+  // Fault in the images and start the workers before anything is timed.
+  classify_samples(net, samples, num_samples, output);
+
+  printf("BATCH  WORKERS      CAT/S  SPEEDUP  EFFICIENCY\n");
+  for (int b = 0; b < (int)(sizeof(batch_sizes) / sizeof(batch_sizes[0])); b++) {
+    net->batch_size = batch_sizes[b];
+    double base = 0.0, prev = 0.0;
+    int prev_w = 0, flagged = 0;
+
+    for (int w = 1; ; w = (w * 2 < max_workers) ? w * 2 : max_workers) {
+      sched_set_workers(w);
+      double best = 0.0;
+      for (int r = 0; r < SCALING_RUNS; r++) {
+        uint64_t t0 = timestamp_us();
+        classify_samples(net, samples, num_samples, output);
+        double rate = 1e6 * num_samples / (double)(timestamp_us() - t0);
+        if (rate > best)
+          best = rate;
+      }
+      if (w == 1)
+        base = best;
+
+      double speedup = best / base;
+      double efficiency = speedup / w;
+      printf("%5d %8d %10.2f %8.2f %10.1f%%", batch_sizes[b], w, best, speedup,
+             100.0 * efficiency);
+      if (w > 1 && best < prev)
+        printf("  <- slower than %d worker%s", prev_w, (prev_w > 1) ? "s" : "");
+      else if (!flagged && efficiency < SCALING_MIN_EFFICIENCY)
+        printf("  <- scaling breaks down");
+      if (efficiency < SCALING_MIN_EFFICIENCY)
+        flagged = 1;
+      printf("\n");
+      fflush(stdout);
+
+      prev = best;
+      prev_w = w;
+      if (w == max_workers)
+        break;
+    }
+  }
+  sched_set_workers(sched_max_workers());
+
+  free_network(net);
+  free(output);
+  free(samples);
+  return 0;
+}
+
+/*
+ * A client of the latency benchmark: a thread that sends its requests one
+ * after the other (a closed loop), each of size images, and records how
+ * long each request and each image in it took.
+ */
+
+typedef struct latency_client {
+  network_t* net;
+  batcher_t* batcher;      // or NULL to classify directly
+  const uint8_t** images;  // the first image of every request
+  int size;
+  int requests;            // after LATENCY_WARMUP untimed ones
+  pthread_barrier_t* warm; // passed twice after the warmup, see do_latency
+  uint64_t* request_ns;    // [requests]
+  uint64_t* image_ns;      // [requests * size]
+} latency_client_t;
+
+static void* latency_client_main(void* arg) {
+  latency_client_t* c = (latency_client_t*)arg;
+  double output[c->size];
+  uint64_t done[c->size];
+
+  for (int r = -LATENCY_WARMUP; r < c->requests; r++) {
+    const uint8_t** images = c->images + (r + LATENCY_WARMUP) * c->size;
+    uint64_t t0 = timestamp_ns();
+    if (c->batcher != NULL)
+      batcher_classify(c->batcher, images, output, c->size, done);
+    else
+      net_classify_images_timed(c->net, images, output, c->size, done);
+    uint64_t t1 = timestamp_ns();
+    if (r == -1) {
+      pthread_barrier_wait(c->warm);
+      pthread_barrier_wait(c->warm);
+    }
+    if (r < 0)
+      continue;
+    c->request_ns[r] = t1 - t0;
+    for (int j = 0; j < c->size; j++)
+      c->image_ns[r * c->size + j] = done[j] - t0;
+  }
+  return NULL;
+}
+
+static int compare_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+// The q-quantile of n sorted values.
+static uint64_t quantile(const uint64_t* sorted, int n, double q) {
+  int i = (int)(q * n);
+  return sorted[(i < n) ? i : n - 1];
+}
+
+/*
+ * Print the percentiles of n latencies (which get sorted) in ms.
+ */
+
+static void print_latencies(const char* what, uint64_t* ns, int n) {
+  qsort(ns, n, sizeof(uint64_t), compare_u64);
+  printf("  %-8s p50 %8.3f  p90 %8.3f  p99 %8.3f  p99.9 %8.3f  max %8.3f ms\n", what,
+         quantile(ns, n, 0.5) / 1e6, quantile(ns, n, 0.9) / 1e6, quantile(ns, n, 0.99) / 1e6,
+         quantile(ns, n, 0.999) / 1e6, ns[n - 1] / 1e6);
+}
+
+/*
+ * Print a histogram of n sorted latencies, with one bucket per power of two
+ * of us.
+ */
+
+static void print_histogram(const uint64_t* ns, int n) {
+  int counts[64] = { 0 };
+  int lo = 63, hi = 0;
+  for (int i = 0; i < n; i++) {
+    uint64_t us = ns[i] / 1000;
+    int b = 0;
+    while (b < 63 && (2ULL << b) <= us)
+      b++;
+    counts[b]++;
+    if (b < lo) lo = b;
+    if (b > hi) hi = b;
+  }
+  int most = 0;
+  for (int b = lo; b <= hi; b++)
+    if (counts[b] > most) most = counts[b];
+  for (int b = lo; b <= hi; b++) {
+    printf("  %8llu - %8llu us %7d |", (b > 0) ? 1ULL << b : 0ULL, (2ULL << b) - 1, counts[b]);
+    for (int i = 0; i < (50 * counts[b] + most - 1) / most; i++)
+      putchar('#');
+    putchar('\n');
+  }
+}
+
+// Parse a comma separated list of up to max numbers into out.
+static int parse_list(const char* s, int* out, int max) {
+  int n = 0;
+  while (*s != '\0' && n < max) {
+    out[n++] = atoi(s);
+    while (*s != '\0' && *s != ',')
+      s++;
+    if (*s == ',')
+      s++;
+  }
+  return n;
+}
+
+/*
+ * Measure the latency of requests as a web front end sends them: for every
+ * request size (images per request) and concurrency (clients sending
+ * requests at the same time), the clients send requests total requests
+ * after LATENCY_WARMUP untimed ones each. Prints the throughput after the
+ * warmup (once all clients are done with it), the percentiles of the
+ * request latencies (until the last image is done) and image latencies
+ * (until the image is done), and a histogram of the request latencies. The
+ * workers of the scheduler are pinned to their CPUs (see sched.c).
+ *
+ * With a max batch size, the requests go through a batcher (see batcher.c),
+ * as a server would. While a batch runs, the next one waits up to a max
+ * delay (LATENCY_BATCH_DELAY_US by default) for more requests. The batcher
+ * statistics count the requests after the warmup.
+ *
+ * Usage: cnn latency [requests] [sizes, e.g. 1,4,16] [concurrency, e.g. 1,2,4]
+ *                    [max batch[,max delay us]]
+ */
+
+int do_latency(int argc, char** argv) {
+  int requests = (argc > 0) ? atoi(argv[0]) : LATENCY_REQUESTS;
+  int sizes[16] = { 1, 4, 16 }, num_sizes = 3;
+  int clients[16] = { 1, 2, 4 }, num_clients = 3;
+  if (argc > 1)
+    num_sizes = parse_list(argv[1], sizes, 16);
+  if (argc > 2)
+    num_clients = parse_list(argv[2], clients, 16);
+  int batching[2] = { 0, LATENCY_BATCH_DELAY_US };
+  if (argc > 3)
+    parse_list(argv[3], batching, 2);
+
+  fprintf(stderr, "\nLATENCY OF %d REQUESTS ON %d WORKERS, %s KERNELS\n", requests,
+          sched_num_workers(), cnn_kernels()->name);
+
+  network_t* net = load_cnn_snapshot(NET_FUSED | NET_HALO);
+  net_reserve_workspaces(net, sched_num_workers());
+  batcher_t* batcher = NULL;
+  if (batching[0] > 0) {
+    batcher = make_batcher(net, batching[0], batching[1]);
+    fprintf(stderr, "BATCHES OF UP TO %d IMAGES, WAITING UP TO %d US\n", batching[0],
+            batching[1]);
+  }
+
+  for (int si = 0; si < num_sizes; si++) {
+    for (int ci = 0; ci < num_clients; ci++) {
+      int size = sizes[si], nc = clients[ci];
+      if (size < 1 || nc < 1)
+        continue;
+      int per_client = (requests + nc - 1) / nc;
+      int per_image = (per_client + LATENCY_WARMUP) * size;
+
+      // Every client gets images of its own, faulted in up front.
+      int* samples = (int*)malloc(sizeof(int) * per_image * nc);
+      for (int i = 0; i < per_image * nc; i++)
+        samples[i] = i % 50000;
+      const uint8_t** images = get_samples(samples, per_image * nc);
+      volatile uint8_t touch = 0;
+      for (int i = 0; i < per_image * nc; i++)
+        touch += images[i][0];
+
+      latency_client_t c[nc];
+      pthread_t threads[nc];
+      pthread_barrier_t warm;
+      pthread_barrier_init(&warm, NULL, nc + 1);
+      uint64_t* request_ns = (uint64_t*)malloc(sizeof(uint64_t) * per_client * nc);
+      uint64_t* image_ns = (uint64_t*)malloc(sizeof(uint64_t) * per_client * nc * size);
+      for (int i = 0; i < nc; i++) {
+        latency_client_t ci = { net, batcher, images + i * per_image, size, per_client, &warm,
+                                request_ns + i * per_client, image_ns + i * per_client * size };
+        c[i] = ci;
+        pthread_create(&threads[i], NULL, latency_client_main, &c[i]);
+      }
+      // Once all clients are warm, start counting while they wait.
+      pthread_barrier_wait(&warm);
+      if (batcher != NULL)
+        batcher_reset_stats(batcher);
+      uint64_t t0 = timestamp_ns();
+      pthread_barrier_wait(&warm);
+      for (int i = 0; i < nc; i++)
+        pthread_join(threads[i], NULL);
+      double seconds = (timestamp_ns() - t0) / 1e9;
+      pthread_barrier_destroy(&warm);
+
+      printf("SIZE %d, CONCURRENCY %d: %d REQUESTS, %.1f REQUESTS/S, %.1f CAT/S\n", size, nc,
+             per_client * nc, per_client * nc / seconds, per_client * nc * size / seconds);
+      print_latencies("request", request_ns, per_client * nc);
+      print_latencies("image", image_ns, per_client * nc * size);
+      print_histogram(request_ns, per_client * nc);
+      if (batcher != NULL)
+        batcher_print_stats(batcher, stdout);
+      printf("\n");
+      fflush(stdout);
+
+      free(request_ns);
+      free(image_ns);
+      free((void*)images);
+      free(samples);
+    }
+  }
+
+  if (batcher != NULL)
+    free_batcher(batcher);
+  free_network(net);
   return 0;
 }
 
@@ -43,13 +343,16 @@ int do_test(int argc, char** argv) {
   assert(sample_num >= 0 && sample_num < 50000);
 
   fprintf(stderr, "Making network...\n");
-  network_t* net = load_cnn_snapshot();
+  network_t* net = load_cnn_snapshot(0);
 
-  batch_t* batch = make_batch(net, 1);
+  plan_memory(net, 1, &net->plan);
+  // The row tasks of net_forward_parallel use the scratch of every worker.
+  net_reserve_workspaces(net, sched_num_workers());
+  batch_t* batch = net_workspace(net, 0)->batch;
   load_sample(batch[0][0], sample_num);
 
   uint64_t start_time = timestamp_us(); 
-  net_forward(net, batch, 0, 0);
+  net_forward_parallel(net, batch, 0, 0);
   uint64_t end_time = timestamp_us();
   fprintf(stderr, "Time: %lf ms\n", (double)(end_time-start_time) / 1000.0);
 
@@ -63,7 +366,7 @@ int do_test(int argc, char** argv) {
     fprintf(stderr, "Category %d: %lf\n", i, net->v11->w[i]);
   }*/
 
-  free_batch(batch, 1);
+  free_network(net);
 }
 
 /*
@@ -94,13 +397,395 @@ int do_partest(int argc, char** argv) {
   free(samples);
 }
 
+/*
+ * Write a binary reference file (see verify.c) with the volumes of count
+ * samples starting at first, as computed by this build. Dump the references
+ * with a build you trust, and verify the next kernel change against them.
+ *
+ * Usage: cnn dump <file> [first] [count]
+ */
+
+int do_dump(int argc, char** argv) {
+  if (argc < 1) {
+    fprintf(stderr, "Usage: ./cnn dump <file> [first] [count]\n");
+    return 2;
+  }
+  int first = (argc > 1) ? atoi(argv[1]) : 0;
+  int count = (argc > 2) ? atoi(argv[2]) : DUMP_SIZE;
+  assert(first >= 0 && count > 0 && first + count <= 50000);
+
+  network_t* net = load_cnn_snapshot(0);
+  int32_t* samples = (int32_t*)malloc(sizeof(int32_t) * count);
+  for (int i = 0; i < count; i++)
+    samples[i] = first + i;
+
+  FILE* f = refs_create(net, argv[0], samples, count);
+  if (f == NULL) {
+    fprintf(stderr, "ERROR: Could not write %s\n", argv[0]);
+    return 1;
+  }
+
+  // A chunk of samples at a time, so the volumes never take much memory.
+  int values = refs_values(net);
+  int chunk = 4 * net->batch_size * sched_num_workers();
+  double* out = (double*)malloc(sizeof(double) * values * chunk);
+  for (int i = 0; i < count; i += chunk) {
+    int n = (count - i < chunk) ? count - i : chunk;
+    net_compute_refs(net, samples + i, n, out);
+    fwrite(out, sizeof(double) * values, n, f);
+  }
+  int err = (fclose(f) != 0);
+  fprintf(stderr, err ? "ERROR: Could not write %s\n" : "Wrote %s\n", argv[0]);
+
+  free(out);
+  free(samples);
+  free_network(net);
+  return err;
+}
+
+/*
+ * Convert text references (as printed by `cnn test <N>`, named <N>.txt) into
+ * one binary reference file.
+ *
+ * Usage: cnn import <file> <N.txt>...
+ */
+
+int do_import(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: ./cnn import <file> <N.txt>...\n");
+    return 2;
+  }
+  int count = argc - 1;
+
+  network_t* net = make_network(0);
+  int values = refs_values(net);
+  int32_t* samples = (int32_t*)malloc(sizeof(int32_t) * count);
+  double* out = (double*)malloc(sizeof(double) * values * count);
+  for (int i = 0; i < count; i++) {
+    const char* fn = argv[i + 1];
+    const char* base = strrchr(fn, '/');
+    samples[i] = atoi((base != NULL) ? base + 1 : fn);
+    if (refs_read_text(net, fn, out + (size_t)i * values) != 0) {
+      fprintf(stderr, "ERROR: %s is not a reference of this network\n", fn);
+      return 1;
+    }
+  }
+
+  FILE* f = refs_create(net, argv[0], samples, count);
+  int err = (f == NULL);
+  if (f != NULL) {
+    fwrite(out, sizeof(double) * values, count, f);
+    err = (fclose(f) != 0);
+  }
+  if (err)
+    fprintf(stderr, "ERROR: Could not write %s\n", argv[0]);
+  else
+    fprintf(stderr, "Wrote %s (%d samples)\n", argv[0], count);
+
+  free(out);
+  free(samples);
+  free_network(net);
+  return err;
+}
+
+/*
+ * Check every volume of all samples of a binary reference file, and print
+ * the first value of every sample (up to VERIFY_MAX_REPORT samples) that is
+ * off by more than the tolerance. Returns 1 if any sample is off.
+ *
+ * Usage: cnn verify <file> [tolerance]
+ */
+
+int do_verify(int argc, char** argv) {
+  if (argc < 1) {
+    fprintf(stderr, "Usage: ./cnn verify <file> [tolerance]\n");
+    return 2;
+  }
+  double tolerance = (argc > 1) ? atof(argv[1]) : VERIFY_TOLERANCE;
+
+  network_t* net = load_cnn_snapshot(0);
+  refs_t refs;
+  if (refs_open(&refs, net, argv[0]) != 0) {
+    free_network(net);
+    return 2;
+  }
+
+  int n = refs.header->num_samples;
+  refs_diff_t* diffs = (refs_diff_t*)malloc(sizeof(refs_diff_t) * n);
+  uint64_t start_time = timestamp_us();
+  int failed = net_verify_refs(net, &refs, tolerance, diffs);
+  uint64_t end_time = timestamp_us();
+
+  double max_err = 0.0;
+  int reported = 0;
+  for (int i = 0; i < n; i++) {
+    refs_diff_t* d = &diffs[i];
+    if (!(d->max_err <= max_err))
+      max_err = d->max_err;
+    if (d->layer >= 0 && reported++ < VERIFY_MAX_REPORT)
+      printf("SAMPLE %d: LAYER%d (%s) at (%d,%d,%d) is %.20lf, should be %.20lf\n",
+             refs.samples[i], d->layer, (d->layer > 0) ? layer_type[d->layer - 1] : "input",
+             d->x, d->y, d->d, d->value, d->expected);
+  }
+  if (reported > VERIFY_MAX_REPORT)
+    printf("... and %d more\n", reported - VERIFY_MAX_REPORT);
+
+  printf("%s: %d OF %d SAMPLES MATCH (TOLERANCE %g, LARGEST ERROR %g), %.1lf ms\n",
+         failed ? "FAILED" : "PASSED", n - failed, n, tolerance, max_err,
+         (end_time - start_time) / 1000.0);
+
+  free(diffs);
+  refs_close(&refs);
+  free_network(net);
+  return failed ? 1 : 0;
+}
+
+/*
+ * Check the numerical accuracy of the network against layer dumps produced
+ * by convnet.js (test/ref/<N>.txt, in the format written by dump_vol). The
+ * LAYER0 line of every dump is used as input, and every other layer is
+ * compared to the reference, using a tolerance relative to the magnitude of
+ * the reference value. This does not need the cifar10 data set, so it can be
+ * used to validate reduced precision builds (-DCNN_FLOAT) anywhere.
+ */
+
+#ifdef CNN_FLOAT
+const double ACCURACY_TOL = 1e-4;
+#else
+const double ACCURACY_TOL = 1e-11;
+#endif
+
+int do_accuracy(int argc, char** argv) {
+  if (argc < 1) {
+    fprintf(stderr, "Usage: ./cnn accuracy <reference dump>...\n");
+    return 2;
+  }
+
+  network_t* net = load_cnn_snapshot(0);
+  plan_memory(net, 1, &net->plan);
+  // The row tasks of net_forward_parallel use the scratch of every worker.
+  net_reserve_workspaces(net, sched_num_workers());
+  batch_t* batch = net_workspace(net, 0)->batch;
+
+  double max_abs[LAYERS+1] = { 0.0 };
+  double max_rel[LAYERS+1] = { 0.0 };
+  int bad_values = 0;
+  int bad_labels = 0;
+
+  for (int f = 0; f < argc; f++) {
+    FILE* fin = fopen(argv[f], "r");
+    assert(fin != NULL);
+    int ref_best = 0;
+    double ref_max = -1.0;
+
+    for (int i = 0; i < LAYERS+1; i++) {
+      vol_t* v = batch[i][0];
+      int layer;
+      long sx, sy, depth;
+      assert(fscanf(fin, " LAYER%d,%ld,%ld,%ld", &layer, &sx, &sy, &depth) == 4);
+      assert(layer == i && sx == v->sx && sy == v->sy && depth == v->depth);
+
+      if (i == 0) {
+        for (int x = 0; x < v->sx; x++)
+          for (int y = 0; y < v->sy; y++)
+            for (int z = 0; z < v->depth; z++) {
+              double val;
+              assert(fscanf(fin, ",%lf", &val) == 1);
+              set_vol(v, x, y, z, val);
+            }
+        net_forward_parallel(net, batch, 0, 0);
+        continue;
+      }
+
+      for (int x = 0; x < v->sx; x++)
+        for (int y = 0; y < v->sy; y++)
+          for (int z = 0; z < v->depth; z++) {
+            double ref;
+            assert(fscanf(fin, ",%lf", &ref) == 1);
+            double err = fabs(get_vol(v, x, y, z) - ref);
+            double rel = err / (fabs(ref) > 1.0 ? fabs(ref) : 1.0);
+            if (err > max_abs[i]) max_abs[i] = err;
+            if (rel > max_rel[i]) max_rel[i] = rel;
+            if (rel > ACCURACY_TOL) bad_values++;
+            if (i == LAYERS && ref > ref_max) {
+              ref_max = ref;
+              ref_best = z;
+            }
+          }
+    }
+
+    // The predicted class has to match the reference as well.
+    vol_t* out = batch[LAYERS][0];
+    int best = 0;
+    for (int z = 1; z < out->depth; z++)
+      if (out->w[z] > out->w[best]) best = z;
+    if (best != ref_best) bad_labels++;
+
+    fclose(fin);
+  }
+
+  fprintf(stderr, "ACCURACY OF %s PRECISION AGAINST %d REFERENCE DUMPS:\n",
+          sizeof(real_t) == sizeof(float) ? "SINGLE" : "DOUBLE", argc);
+  for (int i = 1; i < LAYERS+1; i++)
+    fprintf(stderr, "LAYER %2d: max abs err %.3e, max rel err %.3e\n",
+            i, max_abs[i], max_rel[i]);
+
+  free_network(net);
+
+  if (bad_values > 0 || bad_labels > 0) {
+    fprintf(stderr, "ACCURACY CHECK FAILED: %d values off by more than %g, "
+            "%d images classified differently\n", bad_values, ACCURACY_TOL, bad_labels);
+    return 1;
+  }
+  fprintf(stderr, "ACCURACY CHECK PASSED (tolerance %g)\n", ACCURACY_TOL);
+  return 0;
+}
+
+/*
+ * Calibrate the 8-bit quantized network on a set of samples, then run both
+ * the regular and the quantized network on a different set of samples and
+ * compare their results and speed.
+ */
+
+int do_quant(int argc, char** argv) {
+  int calib_size = (argc > 0) ? atoi(argv[0]) : QUANT_CALIB_SIZE;
+  int test_size = (argc > 1) ? atoi(argv[1]) : BENCHMARK_SIZE;
+
+  // Calibrate on the first samples, test on the ones right after them.
+  int* samples = (int*)malloc(sizeof(int)*(calib_size + test_size));
+  for (int i = 0; i < calib_size + test_size; i++) {
+    samples[i] = i % 50000;
+  }
+
+  network_t* net = load_cnn_snapshot(0);
+  const uint8_t** input = get_samples(samples, calib_size + test_size);
+
+  fprintf(stderr, "Calibrating on %d samples...\n", calib_size);
+  qnet_t* q = make_qnet(net, input, calib_size);
+
+  double* ref = (double*)malloc(sizeof(double)*test_size);
+  double* out = (double*)malloc(sizeof(double)*test_size);
+
+  fprintf(stderr, "Running classification on %d samples...\n", test_size);
+  uint64_t t0 = timestamp_us();
+  net_classify_images(net, input + calib_size, ref, test_size);
+  uint64_t t1 = timestamp_us();
+  qnet_classify_images(q, input + calib_size, out, test_size);
+  uint64_t t2 = timestamp_us();
+
+  int agree = 0;
+  double max_err = 0.0;
+  for (int i = 0; i < test_size; i++) {
+    if ((ref[i] > 0.5) == (out[i] > 0.5)) agree++;
+    if (fabs(ref[i] - out[i]) > max_err) max_err = fabs(ref[i] - out[i]);
+  }
+
+  fprintf(stderr, "\n%s PRECISION: %.2lf Cat/s\n", sizeof(real_t) == sizeof(float) ?
+          "SINGLE" : "DOUBLE", 1e6 * test_size / (double)(t1 - t0));
+  fprintf(stderr, "INT8 QUANTIZED: %.2lf Cat/s\n", 1e6 * test_size / (double)(t2 - t1));
+  fprintf(stderr, "CAT DECISIONS MATCHING: %d / %d (%.2lf %%)\n", agree, test_size,
+          100.0 * agree / test_size);
+  fprintf(stderr, "MAX CAT PROBABILITY ERROR: %lf\n\n", max_err);
+
+  free_qnet(q);
+  free_network(net);
+  free((void*)input);
+  free(samples);
+  free(ref);
+  free(out);
+  return 0;
+}
+
+/*
+ * Profile the layers of the network while it classifies a number of images
+ * (see profile.c). The table goes to stderr; --csv or --json also write the
+ * results to stdout. The network is unfused, so every layer is timed on its
+ * own, unless --fused is given. --counters adds the hardware counters.
+ */
+
+int do_profile(int argc, char** argv) {
+  int num_samples = BENCHMARK_SIZE;
+  int flags = NET_HALO;
+  int csv = 0, json = 0, counters = 0;
+  for (int i = 0; i < argc; i++) {
+    if (!strcmp(argv[i], "--fused"))
+      flags |= NET_FUSED;
+    else if (!strcmp(argv[i], "--csv"))
+      csv = 1;
+    else if (!strcmp(argv[i], "--json"))
+      json = 1;
+    else if (!strcmp(argv[i], "--counters"))
+      counters = 1;
+    else
+      num_samples = atoi(argv[i]);
+  }
+
+  fprintf(stderr, "PROFILING %d PICTURES WITH %s KERNELS ON %d WORKERS\n", num_samples,
+          cnn_kernels()->name, sched_num_workers());
+
+  int* samples = (int*)malloc(sizeof(int)*num_samples);
+  for (int i = 0; i < num_samples; i++) {
+    samples[i] = i % 50000;
+  }
+
+  network_t* net = load_cnn_snapshot(flags);
+  const uint8_t** input = get_samples(samples, num_samples);
+  double* output = (double*)malloc(sizeof(double)*num_samples);
+
+  profile_t* p = profile_start(LAYERS, counters);
+  for (int i = 0; i < LAYERS; i++) {
+    p->name[i] = layer_type[i];
+    net_layer_cost(net, i, &p->flops[i], &p->act_bytes[i], &p->param_bytes[i]);
+  }
+  net_classify_images(net, input, output, num_samples);
+  profile_stop(p);
+
+  fprintf(stderr, "\n");
+  profile_print(p, stderr);
+  fprintf(stderr, "\n");
+  if (csv)
+    profile_print_csv(p, stdout);
+  if (json)
+    profile_print_json(p, stdout);
+
+  free_profile(p);
+  free_network(net);
+  free((void*)input);
+  free(output);
+  free(samples);
+  return 0;
+}
+
+/*
+ * Convert the text snapshot into a binary snapshot for this precision and
+ * these kernels (see snapshot.c).
+ */
+
+int do_convert(int argc, char** argv) {
+  const char* fn = (argc > 0) ? argv[0] : SNAPSHOT_FILE;
+
+  fprintf(stderr, "Loading text snapshot...\n");
+  network_t* net = make_network(0);
+  load_cnn_text(net);
+
+  int err = snapshot_save(net, fn);
+  if (err != 0)
+    fprintf(stderr, "ERROR: Could not write %s\n", fn);
+  else
+    fprintf(stderr, "Wrote %s (%s precision, panel width %d)\n", fn,
+            sizeof(real_t) == sizeof(float) ? "single" : "double", GEMM_NR);
+
+  free_network(net);
+  return (err != 0) ? 1 : 0;
+}
+
 /*
  * The actual main function.
  */
 
 int main(int argc, char** argv) {
   if (argc < 2) {
-    fprintf(stderr, "Usage: ./cnn <benchmark|test|partest> [args]\n");
+    fprintf(stderr, "Usage: ./cnn <benchmark|scaling|latency|test|partest|dump|import|verify|accuracy|quant|profile|convert> [args]\n");
     return 2;
   }
 
@@ -108,6 +793,26 @@ int main(int argc, char** argv) {
     return do_benchmark(argc-2, argv+2);
   }
 
+  if (!strcmp(argv[1], "scaling")) {
+    return do_scaling(argc-2, argv+2);
+  }
+
+  if (!strcmp(argv[1], "latency")) {
+    return do_latency(argc-2, argv+2);
+  }
+
+  if (!strcmp(argv[1], "dump")) {
+    return do_dump(argc-2, argv+2);
+  }
+
+  if (!strcmp(argv[1], "import")) {
+    return do_import(argc-2, argv+2);
+  }
+
+  if (!strcmp(argv[1], "verify")) {
+    return do_verify(argc-2, argv+2);
+  }
+
   if (!strcmp(argv[1], "test")) {
     return do_test(argc-2, argv+2);
   }
@@ -116,6 +821,22 @@ int main(int argc, char** argv) {
     return do_partest(argc-2, argv+2);
   }
 
+  if (!strcmp(argv[1], "accuracy")) {
+    return do_accuracy(argc-2, argv+2);
+  }
+
+  if (!strcmp(argv[1], "quant")) {
+    return do_quant(argc-2, argv+2);
+  }
+
+  if (!strcmp(argv[1], "profile")) {
+    return do_profile(argc-2, argv+2);
+  }
+
+  if (!strcmp(argv[1], "convert")) {
+    return do_convert(argc-2, argv+2);
+  }
+
   fprintf(stderr, "ERROR: Unknown command\n");
 
   return 2;
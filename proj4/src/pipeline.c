@@ -0,0 +1,222 @@
+// Pipeline -------------------------------------------------------------------
+
+/*
+ * Classify a stream of raw images of any length with loading and compute
+ * overlapped. The stream is cut into batches of net->batch_size images, which
+ * go through a bounded ring of slots, each holding the input volumes of one
+ * batch:
+ *
+ *   producers  take a free slot and the next images of the stream, and
+ *              normalize the images into the volumes of the slot (this is
+ *              where the pages of the data set are actually read)
+ *   consumers  take a filled slot, copy it into their workspace (see
+ *              net_reserve_workspaces), put the slot back on the free list,
+ *              run net_forward and hand the results to the sink
+ *
+ * The memory used is fixed by the number of slots, no matter how long the
+ * stream is. The slots are small (a slot is 1/10 of the activations of a
+ * batch), and the consumers keep reusing the same cache-warm workspace. With
+ * two slots per consumer, the next batch of every consumer is normally ready
+ * when it finishes the current one.
+ */
+
+#define PIPE_PRODUCERS 1
+#define PIPE_SLOTS_PER_CONSUMER 2
+
+/*
+ * Source of the stream: stores up to max image pointers in img and returns
+ * how many, 0 at the end of the stream. Called by one producer at a time.
+ */
+
+typedef int (*pipe_source_t)(void* ctx, const uint8_t** img, int max);
+
+/*
+ * Sink of the stream: receives the output volumes (v[LAYERS]) of count images
+ * starting at stream position first. Called by several consumers at once, for
+ * different parts of the stream and in no particular order.
+ */
+
+typedef void (*pipe_sink_t)(void* ctx, int first, vol_t** out, int count);
+
+typedef struct pipe_slot {
+  vol_t** in;
+  const uint8_t** img;
+  int first;
+  int count;
+} pipe_slot_t;
+
+typedef struct pipeline {
+  network_t* net;
+  pipe_source_t source;
+  pipe_sink_t sink;
+  void* ctx;
+
+  int num_slots;
+  pipe_slot_t* slots;
+
+  // FIFO queues of slot indices, each with room for all slots
+  int* free_q;
+  int free_head, free_n;
+  int* full_q;
+  int full_head, full_n;
+
+  int next;          // stream position of the next image to load
+  int eof;           // the source is exhausted
+  int producers;     // producers still running
+
+  pthread_mutex_t lock;
+  pthread_cond_t free_cond;
+  pthread_cond_t full_cond;
+} pipeline_t;
+
+static void pipe_push(int* q, int head, int* n, int size, int slot) {
+  q[(head + *n) % size] = slot;
+  (*n)++;
+}
+
+static int pipe_pop(int* q, int* head, int* n, int size) {
+  int slot = q[*head];
+  *head = (*head + 1) % size;
+  (*n)--;
+  return slot;
+}
+
+static void* pipe_producer(void* arg) {
+  pipeline_t* p = (pipeline_t*)arg;
+
+  pthread_mutex_lock(&p->lock);
+  for (;;) {
+    while (p->free_n == 0 && !p->eof)
+      pthread_cond_wait(&p->free_cond, &p->lock);
+    if (p->eof)
+      break;
+
+    int s = pipe_pop(p->free_q, &p->free_head, &p->free_n, p->num_slots);
+    pipe_slot_t* slot = &p->slots[s];
+    slot->count = p->source(p->ctx, slot->img, p->net->batch_size);
+    slot->first = p->next;
+    p->next += slot->count;
+    if (slot->count == 0) {
+      p->eof = 1;
+      pipe_push(p->free_q, p->free_head, &p->free_n, p->num_slots, s);
+      break;
+    }
+
+    // Normalizing (and faulting in the pages) happens outside the lock.
+    pthread_mutex_unlock(&p->lock);
+    uint64_t t0 = trace_begin();
+    for (int j = 0; j < slot->count; j++)
+      image_to_vol(slot->in[j], slot->img[j]);
+    trace_end("load", -1, "first", slot->first, t0);
+    pthread_mutex_lock(&p->lock);
+
+    pipe_push(p->full_q, p->full_head, &p->full_n, p->num_slots, s);
+    pthread_cond_signal(&p->full_cond);
+  }
+
+  p->producers--;
+  pthread_cond_broadcast(&p->free_cond);
+  pthread_cond_broadcast(&p->full_cond);
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+static void pipe_worker(void* ctx, int i, int worker) {
+  (void)i;
+  pipeline_t* p = (pipeline_t*)ctx;
+  batch_t* batch = net_workspace(p->net, worker)->batch;
+
+  pthread_mutex_lock(&p->lock);
+  for (;;) {
+    while (p->full_n == 0 && p->producers > 0)
+      pthread_cond_wait(&p->full_cond, &p->lock);
+    if (p->full_n == 0)
+      break;
+
+    int s = pipe_pop(p->full_q, &p->full_head, &p->full_n, p->num_slots);
+    pipe_slot_t* slot = &p->slots[s];
+    int first = slot->first;
+    int count = slot->count;
+    pthread_mutex_unlock(&p->lock);
+
+    uint64_t t0 = trace_begin();
+    for (int j = 0; j < count; j++)
+      copy_vol(batch[0][j], slot->in[j]);
+
+    pthread_mutex_lock(&p->lock);
+    pipe_push(p->free_q, p->free_head, &p->free_n, p->num_slots, s);
+    pthread_cond_signal(&p->free_cond);
+    pthread_mutex_unlock(&p->lock);
+
+    net_forward(p->net, batch, 0, count - 1);
+    p->sink(p->ctx, first, batch[LAYERS], count);
+    trace_end("batch", -1, "first", first, t0);
+
+    pthread_mutex_lock(&p->lock);
+  }
+  pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Run the stream given by source through net, and return when all results
+ * have been passed to sink. The producers are threads of their own, since
+ * they mostly wait for the disk. The consumers run as one task per worker of
+ * the scheduler (see sched.c), which they occupy until the stream ends.
+ */
+
+void net_classify_stream(network_t* net, pipe_source_t source, pipe_sink_t sink, void* ctx) {
+  int workers = sched_num_workers();
+  net_reserve_workspaces(net, workers);
+  int bs = net->batch_size;
+  vol_t* v0 = net->v[0];
+
+  pipeline_t p;
+  p.net = net;
+  p.source = source;
+  p.sink = sink;
+  p.ctx = ctx;
+
+  p.num_slots = PIPE_SLOTS_PER_CONSUMER * workers;
+  p.slots = (pipe_slot_t*)malloc(sizeof(pipe_slot_t) * p.num_slots);
+  p.free_q = (int*)malloc(sizeof(int) * p.num_slots);
+  p.full_q = (int*)malloc(sizeof(int) * p.num_slots);
+  for (int i = 0; i < p.num_slots; i++) {
+    p.slots[i].in = (vol_t**)malloc(sizeof(vol_t*) * bs);
+    for (int j = 0; j < bs; j++)
+      p.slots[i].in[j] = make_vol(v0->sx, v0->sy, v0->depth, 0.0);
+    p.slots[i].img = (const uint8_t**)malloc(sizeof(uint8_t*) * bs);
+    p.free_q[i] = i;
+  }
+  p.free_head = 0;
+  p.free_n = p.num_slots;
+  p.full_head = 0;
+  p.full_n = 0;
+  p.next = 0;
+  p.eof = 0;
+  p.producers = PIPE_PRODUCERS;
+
+  pthread_mutex_init(&p.lock, NULL);
+  pthread_cond_init(&p.free_cond, NULL);
+  pthread_cond_init(&p.full_cond, NULL);
+
+  pthread_t producers[PIPE_PRODUCERS];
+  for (int i = 0; i < PIPE_PRODUCERS; i++)
+    pthread_create(&producers[i], NULL, pipe_producer, &p);
+  sched_parallel_for(workers, 1, pipe_worker, &p);
+  for (int i = 0; i < PIPE_PRODUCERS; i++)
+    pthread_join(producers[i], NULL);
+
+  pthread_cond_destroy(&p.full_cond);
+  pthread_cond_destroy(&p.free_cond);
+  pthread_mutex_destroy(&p.lock);
+
+  for (int i = 0; i < p.num_slots; i++) {
+    for (int j = 0; j < bs; j++)
+      free_vol(p.slots[i].in[j]);
+    free(p.slots[i].in);
+    free((void*)p.slots[i].img);
+  }
+  free(p.slots);
+  free(p.free_q);
+  free(p.full_q);
+}
@@ -0,0 +1,419 @@
+// Profiler -------------------------------------------------------------------
+
+/*
+ * Per-layer instrumentation of net_forward. While a profile is active
+ * (between profile_start and profile_stop), every layer that net_forward or
+ * net_forward_parallel runs records the time it took on the calling thread
+ * and the number of images it processed. Each thread only writes its own
+ * counters, so recording needs no locks. Without an active profile, a layer
+ * costs one extra load and branch.
+ *
+ * The FLOP and byte counts are not measured, they come from a model of each
+ * layer that the caller fills in (see net_layer_cost): FLOPs per image, bytes
+ * of activations per image and bytes of parameters per call.
+ *
+ * Optionally, the hardware counters in prof_events are read around every
+ * layer as well, through perf_event_open. Every thread opens its own group
+ * of counters the first time it runs a layer, counting only itself in user
+ * space, which perf_event_paranoid <= 2 allows without privileges. Reading
+ * the group costs a system call per layer, which is why it is off by
+ * default. If the counters can't be opened (no PMU in a VM, or a stricter
+ * paranoid setting), the profile falls back to timing only. For layers split
+ * by net_forward_parallel, the counters only see the rows run by the thread
+ * that started the layer.
+ */
+
+#define PROF_MAX_LAYERS 16
+#define PROF_EVENTS 5
+
+static const struct prof_event {
+  const char* name;
+  uint32_t type;
+  uint64_t config;
+} prof_events[PROF_EVENTS] = {
+  { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { "l1d_misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+    (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+  { "llc_misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+    (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+  { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+typedef struct prof_count {
+  uint64_t ns;
+  uint64_t calls;
+  uint64_t images;
+  uint64_t events[PROF_EVENTS];
+} prof_count_t;
+
+// Time and counter values at the start of a layer.
+typedef struct prof_mark {
+  uint64_t ns;
+  uint64_t events[PROF_EVENTS];
+} prof_mark_t;
+
+typedef struct profile {
+  int num_layers;
+  int num_threads;      // workers of the scheduler, plus one for other threads
+  prof_count_t* count;  // [num_threads][num_layers]
+  int counters;         // read the hardware counters
+  int events_found;     // bit e is set if some thread could count event e
+  uint64_t start_ns;
+  uint64_t wall_ns;
+
+  // cost model, per layer
+  const char* name[PROF_MAX_LAYERS];
+  double flops[PROF_MAX_LAYERS];        // per image
+  double act_bytes[PROF_MAX_LAYERS];    // per image
+  double param_bytes[PROF_MAX_LAYERS];  // per call
+} profile_t;
+
+profile_t* net_profile = NULL;
+
+/*
+ * The counters of the calling thread: prof_fd is the group leader, or -1 if
+ * the counters are not available, and prof_slot[e] is the position of event
+ * e in the group, or -1 if this event couldn't be opened.
+ */
+
+static __thread int prof_fd = -2;
+static __thread int prof_slot[PROF_EVENTS];
+static int prof_warned = 0;
+
+static void prof_open_counters(void) {
+  int n = 0;
+  prof_fd = -1;
+  for (int e = 0; e < PROF_EVENTS; e++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = prof_events[e].type;
+    attr.config = prof_events[e].config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    int fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, prof_fd, 0);
+    prof_slot[e] = (fd >= 0) ? n++ : -1;
+    if (fd >= 0 && prof_fd < 0)
+      prof_fd = fd;
+    if (fd < 0 && e == 0)
+      break;
+  }
+
+  if (prof_fd < 0 && !__atomic_exchange_n(&prof_warned, 1, __ATOMIC_SEQ_CST))
+    fprintf(stderr, "WARNING: No hardware counters (%s), timing layers only\n",
+            strerror(errno));
+}
+
+/*
+ * Read the counters of the calling thread into events, scaled up if the
+ * kernel had to multiplex them. Events that aren't counted stay 0.
+ */
+
+static void prof_read_counters(uint64_t* events) {
+  uint64_t buf[3 + PROF_EVENTS];
+  memset(events, 0, sizeof(uint64_t) * PROF_EVENTS);
+  if (prof_fd == -2)
+    prof_open_counters();
+  if (prof_fd < 0 || read(prof_fd, buf, sizeof(buf)) < (ssize_t)(3 * sizeof(uint64_t)))
+    return;
+
+  double scale = (buf[2] > 0 && buf[2] < buf[1]) ? (double)buf[1] / buf[2] : 1.0;
+  for (int e = 0; e < PROF_EVENTS; e++)
+    if (prof_slot[e] >= 0 && (uint64_t)prof_slot[e] < buf[0])
+      events[e] = (uint64_t)(buf[3 + prof_slot[e]] * scale);
+}
+
+static inline void prof_begin(prof_mark_t* m) {
+  profile_t* p = net_profile;
+  m->ns = 0;
+  if (p == NULL)
+    return;
+  if (p->counters)
+    prof_read_counters(m->events);
+  m->ns = timestamp_ns();
+}
+
+static inline void prof_end(int layer, int images, prof_mark_t* m) {
+  profile_t* p = net_profile;
+  if (p == NULL || m->ns == 0)
+    return;
+  uint64_t now = timestamp_ns();
+  int t = sched_worker_id();
+  if (t < 0)
+    t = p->num_threads - 1;
+  prof_count_t* c = &p->count[t * p->num_layers + layer];
+  c->ns += now - m->ns;
+  c->calls++;
+  c->images += images;
+
+  if (p->counters && prof_fd >= 0) {
+    uint64_t events[PROF_EVENTS];
+    prof_read_counters(events);
+    for (int e = 0; e < PROF_EVENTS; e++) {
+      c->events[e] += events[e] - m->events[e];
+      if (prof_slot[e] >= 0 && !(p->events_found & (1 << e)))
+        __atomic_or_fetch(&p->events_found, 1 << e, __ATOMIC_SEQ_CST);
+    }
+  }
+}
+
+// Run call as layer number layer on images images, profiled and traced.
+#define PROFILE(layer, images, call) do {                     \
+    prof_mark_t prof_mark;                                    \
+    uint64_t trace_t0 = trace_begin();                        \
+    prof_begin(&prof_mark);                                   \
+    call;                                                     \
+    prof_end(layer, images, &prof_mark);                      \
+    trace_end("LAYER", layer, "images", images, trace_t0);    \
+  } while (0)
+
+/*
+ * Start recording into a new profile of num_layers layers, with the hardware
+ * counters if counters is set. The cost model is zero until the caller fills
+ * it in. Must not be called while the network is running.
+ */
+
+profile_t* profile_start(int num_layers, int counters) {
+  assert(num_layers <= PROF_MAX_LAYERS);
+  profile_t* p = (profile_t*)calloc(1, sizeof(profile_t));
+  p->num_layers = num_layers;
+  p->counters = counters;
+  p->num_threads = sched_max_workers() + 1;
+  p->count = (prof_count_t*)calloc(p->num_threads * num_layers, sizeof(prof_count_t));
+  p->start_ns = timestamp_ns();
+  net_profile = p;
+  return p;
+}
+
+void profile_stop(profile_t* p) {
+  p->wall_ns = timestamp_ns() - p->start_ns;
+  if (net_profile == p)
+    net_profile = NULL;
+}
+
+void free_profile(profile_t* p) {
+  free(p->count);
+  free(p);
+}
+
+// Totals of layer i over all threads.
+static prof_count_t prof_layer(profile_t* p, int i) {
+  prof_count_t sum;
+  memset(&sum, 0, sizeof(sum));
+  for (int t = 0; t < p->num_threads; t++) {
+    prof_count_t* c = &p->count[t * p->num_layers + i];
+    sum.ns += c->ns;
+    sum.calls += c->calls;
+    sum.images += c->images;
+    for (int e = 0; e < PROF_EVENTS; e++)
+      sum.events[e] += c->events[e];
+  }
+  return sum;
+}
+
+// Totals of thread t over all layers.
+static prof_count_t prof_thread(profile_t* p, int t) {
+  prof_count_t sum;
+  memset(&sum, 0, sizeof(sum));
+  for (int i = 0; i < p->num_layers; i++) {
+    prof_count_t* c = &p->count[t * p->num_layers + i];
+    sum.ns += c->ns;
+    sum.calls += c->calls;
+    sum.images += c->images;
+    for (int e = 0; e < PROF_EVENTS; e++)
+      sum.events[e] += c->events[e];
+  }
+  return sum;
+}
+
+static double prof_flops(profile_t* p, int i, prof_count_t c) {
+  return p->flops[i] * c.images;
+}
+
+static double prof_bytes(profile_t* p, int i, prof_count_t c) {
+  return p->act_bytes[i] * c.images + p->param_bytes[i] * c.calls;
+}
+
+// Work per ns is the same number as work in G per s.
+static double prof_rate(double work, uint64_t ns) {
+  return (ns > 0) ? work / ns : 0.0;
+}
+
+// Modeled work of thread t over all layers.
+static void prof_thread_work(profile_t* p, int t, double* flops, double* bytes) {
+  *flops = 0.0;
+  *bytes = 0.0;
+  for (int i = 0; i < p->num_layers; i++) {
+    prof_count_t c = p->count[t * p->num_layers + i];
+    *flops += prof_flops(p, i, c);
+    *bytes += prof_bytes(p, i, c);
+  }
+}
+
+static int prof_has_event(profile_t* p, int e) {
+  return p->counters && (p->events_found & (1 << e));
+}
+
+/*
+ * A counter row: millions of cycles, instructions per cycle, and the misses
+ * per thousand instructions. Events that weren't counted are shown as "-".
+ */
+
+static void prof_print_events(profile_t* p, FILE* f, prof_count_t* c) {
+  double instr = (double)c->events[1];
+  if (prof_has_event(p, 0))
+    fprintf(f, " %9.2f", c->events[0] / 1e6);
+  else
+    fprintf(f, " %9s", "-");
+  if (prof_has_event(p, 0) && prof_has_event(p, 1) && c->events[0] > 0)
+    fprintf(f, " %6.2f", instr / c->events[0]);
+  else
+    fprintf(f, " %6s", "-");
+  for (int e = 2; e < PROF_EVENTS; e++) {
+    if (prof_has_event(p, e) && prof_has_event(p, 1) && instr > 0)
+      fprintf(f, " %9.3f", 1000.0 * c->events[e] / instr);
+    else
+      fprintf(f, " %9s", "-");
+  }
+  fprintf(f, "\n");
+}
+
+/*
+ * The time of a layer is summed over the threads that ran it, so the
+ * percentages are shares of the time spent in the network, and GFLOP/s and
+ * GB/s are the rates of one thread running the layer.
+ */
+
+void profile_print(profile_t* p, FILE* f) {
+  uint64_t total_ns = 0;
+  double total_flops = 0.0, total_bytes = 0.0;
+  for (int i = 0; i < p->num_layers; i++) {
+    prof_count_t c = prof_layer(p, i);
+    total_ns += c.ns;
+    total_flops += prof_flops(p, i, c);
+    total_bytes += prof_bytes(p, i, c);
+  }
+
+  fprintf(f, "LAYER  TYPE        CALLS  IMAGES   TIME (ms)      %%     MFLOP  GFLOP/s     GB/s\n");
+  for (int i = 0; i < p->num_layers; i++) {
+    prof_count_t c = prof_layer(p, i);
+    fprintf(f, "%5d  %-8s %8lu %7lu %11.3f %6.2f %9.1f %8.2f %8.2f\n", i,
+            p->name[i] ? p->name[i] : "", (unsigned long)c.calls, (unsigned long)c.images,
+            c.ns / 1e6, (total_ns > 0) ? 100.0 * c.ns / total_ns : 0.0,
+            prof_flops(p, i, c) / 1e6, prof_rate(prof_flops(p, i, c), c.ns),
+            prof_rate(prof_bytes(p, i, c), c.ns));
+  }
+  fprintf(f, "TOTAL                             %11.3f %6.2f %9.1f %8.2f %8.2f\n",
+          total_ns / 1e6, 100.0, total_flops / 1e6, prof_rate(total_flops, total_ns),
+          prof_rate(total_bytes, total_ns));
+
+  if (p->counters && p->events_found) {
+    fprintf(f, "\nLAYER  TYPE       MCYCLES    IPC  L1D MPKI  LLC MPKI   BR MPKI\n");
+    for (int i = 0; i < p->num_layers; i++) {
+      prof_count_t c = prof_layer(p, i);
+      fprintf(f, "%5d  %-8s", i, p->name[i] ? p->name[i] : "");
+      prof_print_events(p, f, &c);
+    }
+  }
+
+  fprintf(f, "\nTHREAD   TIME (ms)   BUSY  GFLOP/s");
+  if (p->counters && p->events_found)
+    fprintf(f, "   MCYCLES    IPC  L1D MPKI  LLC MPKI   BR MPKI");
+  fprintf(f, "\n");
+  for (int t = 0; t < p->num_threads; t++) {
+    prof_count_t c = prof_thread(p, t);
+    double flops, bytes;
+    prof_thread_work(p, t, &flops, &bytes);
+    if (c.ns == 0)
+      continue;
+    if (t == p->num_threads - 1)
+      fprintf(f, " other");
+    else
+      fprintf(f, "%6d", t);
+    fprintf(f, " %11.3f %5.1f%% %8.2f", c.ns / 1e6,
+            (p->wall_ns > 0) ? 100.0 * c.ns / p->wall_ns : 0.0, prof_rate(flops, c.ns));
+    if (p->counters && p->events_found)
+      prof_print_events(p, f, &c);
+    else
+      fprintf(f, "\n");
+  }
+  fprintf(f, "\nWALL TIME: %.3f ms, %.2f GFLOP/s over all threads\n",
+          p->wall_ns / 1e6, prof_rate(total_flops, p->wall_ns));
+}
+
+/*
+ * One row per layer and one per thread (the threads have an empty type and
+ * "other" for threads outside the scheduler), times in ms. The counter
+ * columns are empty for events that weren't counted.
+ */
+
+static void prof_csv_row(profile_t* p, FILE* f, prof_count_t* c, double flops, double bytes) {
+  fprintf(f, ",%lu,%lu,%.6f,%.3f,%.3f,%.4f,%.4f", (unsigned long)c->calls,
+          (unsigned long)c->images, c->ns / 1e6, flops / 1e6, bytes / 1e6,
+          prof_rate(flops, c->ns), prof_rate(bytes, c->ns));
+  for (int e = 0; e < PROF_EVENTS; e++) {
+    if (prof_has_event(p, e))
+      fprintf(f, ",%lu", (unsigned long)c->events[e]);
+    else
+      fprintf(f, ",");
+  }
+  fprintf(f, "\n");
+}
+
+void profile_print_csv(profile_t* p, FILE* f) {
+  fprintf(f, "scope,id,type,calls,images,time_ms,mflop,mbyte,gflops,gbs");
+  for (int e = 0; e < PROF_EVENTS; e++)
+    fprintf(f, ",%s", prof_events[e].name);
+  fprintf(f, "\n");
+
+  for (int i = 0; i < p->num_layers; i++) {
+    prof_count_t c = prof_layer(p, i);
+    fprintf(f, "layer,%d,%s", i, p->name[i] ? p->name[i] : "");
+    prof_csv_row(p, f, &c, prof_flops(p, i, c), prof_bytes(p, i, c));
+  }
+  for (int t = 0; t < p->num_threads; t++) {
+    prof_count_t c = prof_thread(p, t);
+    double flops, bytes;
+    prof_thread_work(p, t, &flops, &bytes);
+    if (t == p->num_threads - 1)
+      fprintf(f, "thread,other,");
+    else
+      fprintf(f, "thread,%d,", t);
+    prof_csv_row(p, f, &c, flops, bytes);
+  }
+}
+
+/*
+ * The same as one JSON object, with the wall time and the time of every
+ * layer on each thread (the last one stands for all threads outside the
+ * scheduler). Only the counted events appear in "counters".
+ */
+
+void profile_print_json(profile_t* p, FILE* f) {
+  fprintf(f, "{\n  \"wall_ms\": %.6f,\n  \"threads\": %d,\n  \"layers\": [\n",
+          p->wall_ns / 1e6, p->num_threads);
+  for (int i = 0; i < p->num_layers; i++) {
+    prof_count_t c = prof_layer(p, i);
+    double flops = prof_flops(p, i, c), bytes = prof_bytes(p, i, c);
+    fprintf(f, "    {\"layer\": %d, \"type\": \"%s\", \"calls\": %lu, \"images\": %lu, "
+            "\"time_ms\": %.6f, \"mflop\": %.3f, \"mbyte\": %.3f, \"gflops\": %.4f, "
+            "\"gbs\": %.4f, \"thread_ms\": [", i, p->name[i] ? p->name[i] : "",
+            (unsigned long)c.calls, (unsigned long)c.images, c.ns / 1e6, flops / 1e6,
+            bytes / 1e6, prof_rate(flops, c.ns), prof_rate(bytes, c.ns));
+    for (int t = 0; t < p->num_threads; t++)
+      fprintf(f, "%s%.6f", (t > 0) ? ", " : "", p->count[t * p->num_layers + i].ns / 1e6);
+    fprintf(f, "], \"counters\": {");
+    const char* sep = "";
+    for (int e = 0; e < PROF_EVENTS; e++) {
+      if (!prof_has_event(p, e))
+        continue;
+      fprintf(f, "%s\"%s\": %lu", sep, prof_events[e].name, (unsigned long)c.events[e]);
+      sep = ", ";
+    }
+    fprintf(f, "}}%s\n", (i + 1 < p->num_layers) ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+}
@@ -3,11 +3,323 @@
 #include <Python.h>
 
 #include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "timestamp.c"
 
 // These are wrapper functions that the Python server is calling into
 // in order to launch classification.
 
-double run_classification(int* samples, int n, double** keep_output);
+typedef struct network network_t;
+typedef struct batcher batcher_t;
+
+network_t* load_cnn_snapshot(int flags);
+void free_network(network_t* net);
+void net_reserve_workspaces(network_t* net, int n);
+void net_classify_images(network_t* net, const uint8_t** input, double* output, int n);
+const uint8_t* get_image(int sample_num);
+int sched_max_workers(void);
+batcher_t* make_batcher(network_t* net, int max_batch, int max_delay_us);
+void batcher_classify(batcher_t* b, const uint8_t** input, double* output, int n,
+                      uint64_t* done);
+void free_batcher(batcher_t* b);
+
+// Must match cnn.c and util.c.
+#define NET_FUSED 1
+#define NET_HALO 2
+#define IMAGE_SIZE 3072
+#define NUM_SAMPLES 50000
+
+/*
+ * cnnModule.Model is the network, loaded once and kept for any number of
+ * requests:
+ *
+ *   model = cnnModule.Model()
+ *   out = model.classify(samples[, out])
+ *   out = model.classify_images(images[, out])
+ *
+ * samples are sample numbers of the data set, as a list or as any buffer of
+ * 32 or 64 bit integers (e.g., a NumPy array). images are raw images (see
+ * image_to_vol), as a buffer of n * 3072 bytes. The cat likelihood of every
+ * image is written into out, a writable buffer of n doubles, or into a new
+ * bytearray (numpy.frombuffer(out) views it without a copy). Buffers are
+ * used in place, never copied.
+ *
+ * The GIL is released while the network runs, and any number of Python
+ * threads may classify with the same model at once.
+ *
+ * cnnModule.Batcher(model[, max_batch[, max_delay_ms]]) has the same
+ * methods, but runs the requests of all threads together in batches of up
+ * to max_batch images. While a batch runs, the next one waits up to
+ * max_delay_ms for more requests (see batcher.c). This is what a server
+ * with many concurrent small requests should use.
+ */
+
+typedef struct model {
+  PyObject_HEAD
+  network_t* net;
+} model_t;
+
+// get_image maps the batch files on first use, which isn't thread safe.
+static pthread_mutex_t image_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int model_init(model_t* self, PyObject* args, PyObject* kwds) {
+  if (self->net != NULL)
+    return 0;
+  Py_BEGIN_ALLOW_THREADS
+  self->net = load_cnn_snapshot(NET_FUSED | NET_HALO);
+  // Reserved once for good, classifying never reserves them again.
+  net_reserve_workspaces(self->net, sched_max_workers());
+  Py_END_ALLOW_THREADS
+  return 0;
+}
+
+static void model_dealloc(model_t* self) {
+  if (self->net != NULL)
+    free_network(self->net);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/*
+ * Get the output buffer for n results: out if it is one (as a new
+ * reference), or a new bytearray if out is NULL or None.
+ */
+
+static PyObject* get_output(PyObject* out, int n, Py_buffer* view) {
+  if (out == NULL || out == Py_None)
+    out = PyByteArray_FromStringAndSize(NULL, sizeof(double) * n);
+  else
+    Py_INCREF(out);
+  if (out == NULL)
+    return NULL;
+
+  int flags = PyBUF_WRITABLE | PyBUF_FORMAT | PyBUF_C_CONTIGUOUS;
+  if (PyObject_GetBuffer(out, view, flags) != 0) {
+    Py_DECREF(out);
+    return NULL;
+  }
+  // Doubles, or plain bytes like a bytearray.
+  if (view->itemsize != 1 &&
+      (view->itemsize != sizeof(double) || view->format[strspn(view->format, "@=<")] != 'd')) {
+    PyErr_SetString(PyExc_TypeError, "output must be a buffer of doubles");
+    PyBuffer_Release(view);
+    Py_DECREF(out);
+    return NULL;
+  }
+  if (view->len < (Py_ssize_t)sizeof(double) * n) {
+    PyErr_Format(PyExc_ValueError, "output needs room for %d doubles", n);
+    PyBuffer_Release(view);
+    Py_DECREF(out);
+    return NULL;
+  }
+  return out;
+}
+
+/*
+ * Classify n images with net, or with batcher if it isn't NULL.
+ */
+
+static PyObject* classify(network_t* net, batcher_t* batcher, const uint8_t** input, int n,
+                          PyObject* out) {
+  Py_buffer view;
+  out = get_output(out, n, &view);
+  if (out == NULL)
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  if (batcher != NULL)
+    batcher_classify(batcher, input, (double*)view.buf, n, NULL);
+  else
+    net_classify_images(net, input, (double*)view.buf, n);
+  Py_END_ALLOW_THREADS
+
+  PyBuffer_Release(&view);
+  return out;
+}
+
+/*
+ * Look up the sample numbers of a list or an integer buffer. Returns the
+ * number of images, or -1 with an exception set.
+ */
+
+static int lookup_samples(PyObject* samples, const uint8_t*** input) {
+  int n;
+  long* numbers;
+  if (PyList_Check(samples)) {
+    n = (int)PyList_Size(samples);
+    numbers = (long*)malloc(sizeof(long) * (n + 1));
+    for (int i = 0; i < n; i++)
+      numbers[i] = PyInt_AsLong(PyList_GetItem(samples, i));
+  } else {
+    Py_buffer view;
+    if (PyObject_GetBuffer(samples, &view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) != 0)
+      return -1;
+    char type = view.format[strspn(view.format, "@=<")];
+    if (view.itemsize != 4 && view.itemsize != 8) {
+      PyErr_SetString(PyExc_TypeError, "samples must be 32 or 64 bit integers");
+      PyBuffer_Release(&view);
+      return -1;
+    }
+    if (type == '\0' || strchr("ilq", type) == NULL) {
+      PyErr_SetString(PyExc_TypeError, "samples must be signed integers");
+      PyBuffer_Release(&view);
+      return -1;
+    }
+    n = (int)(view.len / view.itemsize);
+    numbers = (long*)malloc(sizeof(long) * (n + 1));
+    for (int i = 0; i < n; i++)
+      numbers[i] = (view.itemsize == 4) ? ((int32_t*)view.buf)[i] : ((int64_t*)view.buf)[i];
+    PyBuffer_Release(&view);
+  }
+
+  for (int i = 0; i < n; i++) {
+    if (numbers[i] < 0 || numbers[i] >= NUM_SAMPLES) {
+      if (!PyErr_Occurred())
+        PyErr_Format(PyExc_ValueError, "no sample %ld", numbers[i]);
+      free(numbers);
+      return -1;
+    }
+  }
+
+  *input = (const uint8_t**)malloc(sizeof(uint8_t*) * (n + 1));
+  Py_BEGIN_ALLOW_THREADS
+  pthread_mutex_lock(&image_lock);
+  for (int i = 0; i < n; i++)
+    (*input)[i] = get_image((int)numbers[i]);
+  pthread_mutex_unlock(&image_lock);
+  Py_END_ALLOW_THREADS
+  free(numbers);
+  return n;
+}
+
+static PyObject* classify_samples_arg(network_t* net, batcher_t* batcher, PyObject* args) {
+  PyObject* samples;
+  PyObject* out = NULL;
+  if (!PyArg_ParseTuple(args, "O|O", &samples, &out))
+    return NULL;
+
+  const uint8_t** input;
+  int n = lookup_samples(samples, &input);
+  if (n < 0)
+    return NULL;
+  PyObject* result = classify(net, batcher, input, n, out);
+  free((void*)input);
+  return result;
+}
+
+static PyObject* classify_images_arg(network_t* net, batcher_t* batcher, PyObject* args) {
+  PyObject* images;
+  PyObject* out = NULL;
+  if (!PyArg_ParseTuple(args, "O|O", &images, &out))
+    return NULL;
+
+  Py_buffer view;
+  if (PyObject_GetBuffer(images, &view, PyBUF_C_CONTIGUOUS) != 0)
+    return NULL;
+  if (view.len % IMAGE_SIZE != 0) {
+    PyErr_Format(PyExc_ValueError, "images must be a multiple of %d bytes", IMAGE_SIZE);
+    PyBuffer_Release(&view);
+    return NULL;
+  }
+
+  int n = (int)(view.len / IMAGE_SIZE);
+  const uint8_t** input = (const uint8_t**)malloc(sizeof(uint8_t*) * (n + 1));
+  for (int i = 0; i < n; i++)
+    input[i] = (const uint8_t*)view.buf + (size_t)i * IMAGE_SIZE;
+  PyObject* result = classify(net, batcher, input, n, out);
+  free((void*)input);
+  PyBuffer_Release(&view);
+  return result;
+}
+
+static PyObject* model_classify(model_t* self, PyObject* args) {
+  return classify_samples_arg(self->net, NULL, args);
+}
+
+static PyObject* model_classify_images(model_t* self, PyObject* args) {
+  return classify_images_arg(self->net, NULL, args);
+}
+
+static PyMethodDef model_methods[] = {
+  {"classify", (PyCFunction)model_classify, METH_VARARGS,
+   "classify(samples[, out]): cat likelihoods of the given samples"},
+  {"classify_images", (PyCFunction)model_classify_images, METH_VARARGS,
+   "classify_images(images[, out]): cat likelihoods of raw 3072 byte images"},
+  {NULL, NULL}
+};
+
+static PyTypeObject model_type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "cnnModule.Model",                 // tp_name
+  sizeof(model_t),                   // tp_basicsize
+  0,                                 // tp_itemsize
+  (destructor)model_dealloc,         // tp_dealloc
+};
+
+typedef struct py_batcher {
+  PyObject_HEAD
+  model_t* model;
+  batcher_t* batcher;
+} py_batcher_t;
+
+// Defaults of cnnModule.Batcher.
+#define BATCHER_MAX_BATCH 16
+#define BATCHER_MAX_DELAY_MS 1.0
+
+static int py_batcher_init(py_batcher_t* self, PyObject* args, PyObject* kwds) {
+  static char* keywords[] = { "model", "max_batch", "max_delay_ms", NULL };
+  model_t* model;
+  int max_batch = BATCHER_MAX_BATCH;
+  double max_delay_ms = BATCHER_MAX_DELAY_MS;
+  if (self->batcher != NULL)
+    return 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|id", keywords, &model_type, &model,
+                                   &max_batch, &max_delay_ms))
+    return -1;
+  if (max_batch < 1 || max_delay_ms < 0.0) {
+    PyErr_SetString(PyExc_ValueError, "max_batch must be positive, max_delay_ms not negative");
+    return -1;
+  }
+
+  Py_INCREF(model);
+  self->model = model;
+  self->batcher = make_batcher(model->net, max_batch, (int)(max_delay_ms * 1000.0));
+  return 0;
+}
+
+static void py_batcher_dealloc(py_batcher_t* self) {
+  if (self->batcher != NULL)
+    free_batcher(self->batcher);
+  Py_XDECREF(self->model);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject* py_batcher_classify(py_batcher_t* self, PyObject* args) {
+  return classify_samples_arg(self->model->net, self->batcher, args);
+}
+
+static PyObject* py_batcher_classify_images(py_batcher_t* self, PyObject* args) {
+  return classify_images_arg(self->model->net, self->batcher, args);
+}
+
+static PyMethodDef py_batcher_methods[] = {
+  {"classify", (PyCFunction)py_batcher_classify, METH_VARARGS,
+   "classify(samples[, out]): cat likelihoods of the given samples"},
+  {"classify_images", (PyCFunction)py_batcher_classify_images, METH_VARARGS,
+   "classify_images(images[, out]): cat likelihoods of raw 3072 byte images"},
+  {NULL, NULL}
+};
+
+static PyTypeObject py_batcher_type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "cnnModule.Batcher",               // tp_name
+  sizeof(py_batcher_t),              // tp_basicsize
+  0,                                 // tp_itemsize
+  (destructor)py_batcher_dealloc,    // tp_dealloc
+};
+
+// Model RunCNNClassifier uses, created by its first call.
+static model_t* default_model = NULL;
 
 static PyObject* py_run_cnn_classifier(PyObject* self, PyObject* args)
 {
@@ -17,20 +329,32 @@ static PyObject* py_run_cnn_classifier(PyObject* self, PyObject* args)
     return NULL;
   }
 
-  int* samples = (int*)malloc(sizeof(int)*PyList_Size(input));
-  for (int i = 0; i < PyList_Size(input); i++) {
-    samples[i] = (int) PyInt_AsLong(PyList_GetItem(input, (Py_ssize_t) i));
+  if (default_model == NULL) {
+    default_model = (model_t*)PyObject_CallObject((PyObject*)&model_type, NULL);
+    if (default_model == NULL)
+      return NULL;
   }
 
-  double dt = run_classification(samples, PyList_Size(input), NULL);
+  const uint8_t** images;
+  int n = lookup_samples(input, &images);
+  if (n < 0)
+    return NULL;
+  double* output = (double*)malloc(sizeof(double) * (n + 1));
+
+  uint64_t start_time = timestamp_ns();
+  Py_BEGIN_ALLOW_THREADS
+  net_classify_images(default_model->net, images, output, n);
+  Py_END_ALLOW_THREADS
+  uint64_t end_time = timestamp_ns();
 
-  for (int i = 0; i < PyList_Size(input); i++) {
-    PyList_SetItem(input, (Py_ssize_t)i, PyInt_FromLong(samples[i]));
+  for (int i = 0; i < n; i++) {
+    PyList_SetItem(input, (Py_ssize_t)i, PyInt_FromLong((output[i] > 0.5) ? 0 : -1));
   }
 
-  free(samples);
+  free(output);
+  free((void*)images);
 
-  return Py_BuildValue("d", dt);
+  return Py_BuildValue("d", (double)(end_time - start_time) / 1e6);
 }
 
 static PyMethodDef myModule_methods[] = {
@@ -40,5 +364,26 @@ static PyMethodDef myModule_methods[] = {
 
 void initcnnModule()
 {
-  (void) Py_InitModule("cnnModule", myModule_methods);
+  model_type.tp_flags = Py_TPFLAGS_DEFAULT;
+  model_type.tp_doc = "The network, loaded once (see python.c)";
+  model_type.tp_methods = model_methods;
+  model_type.tp_init = (initproc)model_init;
+  model_type.tp_new = PyType_GenericNew;
+  if (PyType_Ready(&model_type) < 0)
+    return;
+  py_batcher_type.tp_flags = Py_TPFLAGS_DEFAULT;
+  py_batcher_type.tp_doc = "Batches the requests of all threads (see python.c)";
+  py_batcher_type.tp_methods = py_batcher_methods;
+  py_batcher_type.tp_init = (initproc)py_batcher_init;
+  py_batcher_type.tp_new = PyType_GenericNew;
+  if (PyType_Ready(&py_batcher_type) < 0)
+    return;
+
+  PyObject* m = Py_InitModule("cnnModule", myModule_methods);
+  if (m == NULL)
+    return;
+  Py_INCREF(&model_type);
+  PyModule_AddObject(m, "Model", (PyObject*)&model_type);
+  Py_INCREF(&py_batcher_type);
+  PyModule_AddObject(m, "Batcher", (PyObject*)&py_batcher_type);
 }
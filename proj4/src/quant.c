@@ -0,0 +1,691 @@
+// Quantized Network ----------------------------------------------------------
+
+/*
+ * An 8-bit execution path for the network. It is built from an (unfused)
+ * network that has already been loaded with load_cnn_snapshot and a set of
+ * calibration images (raw, as mapped by get_image):
+ *
+ *  - Every conv/fc filter gets its own (per output channel) weight scale, so
+ *    that its largest weight maps to +-127.
+ *  - The calibration images are run through the regular network, recording
+ *    the largest absolute value of the input and of every conv output. These
+ *    ranges become the scales of the quantized activations.
+ *
+ * Activations are stored as uint8_t in the usual vol_t layout (4x smaller
+ * than float, 8x smaller than double). Every conv output goes through relu,
+ * so the activations after the first layer are in [0, 127] and need no zero
+ * point. The input of the first layer is signed; it is quantized to 7 bits,
+ * [-63, 63], and stored with 64 added (in_zero), which the bias of that layer
+ * takes off again. This keeps every activation below 128 (see qgemm), and
+ * costs less accuracy than 7 bit weights in the first layer. The input comes
+ * straight from the raw image bytes through a table, and is stored with a
+ * halo of zeros (in_zero) as wide as the conv padding, like the pool outputs
+ * that are the input of the next conv layer. im2col is then a copy of one
+ * filter row after the other, without any bounds checks.
+ *
+ * Conv and fc run on qgemm, an int8 version of gemm (see gemm.c), and relu
+ * is part of its epilogue. Max pooling preserves the scale, so it runs
+ * directly on the uint8 tensors. Only the 10 fc outputs are converted back
+ * to real_t for softmax.
+ */
+
+typedef struct qlayer {
+  int out_depth;
+  int k;          // inputs per output (filter size)
+  int kp;         // k rounded up to a multiple of 4
+  int8_t* w;      // quantized weights, packed by qgemm_pack
+  // Per output channel (padded to whole panels): output = acc * mult + add.
+  float* mult;
+  float* add;
+  int out_float;  // the outputs are real values (floats), not quantized
+} qlayer_t;
+
+/*
+ * The per image buffers of a worker (see qnet_buffers).
+ */
+
+typedef struct qbuffers {
+  uint8_t* in[3];    // conv inputs, with halo
+  uint8_t* out;      // conv output, relu applied
+  uint8_t* fc;       // fc input, QGEMM_MR rows of fc.kp
+  uint8_t* col;      // im2col patches, QCONV_MC rows
+  float* logits;     // fc output, one panel
+} qbuffers_t;
+
+typedef struct qnet {
+  network_t* net;
+  float in_scale;
+  int in_zero;             // quantized input value of 0.0
+  uint8_t in_lut[256];     // raw pixel to quantized input
+  qlayer_t conv[3];
+  qlayer_t fc;
+  int num_scratch;         // one scratch per worker
+  uint8_t** scratch;
+} qnet_t;
+
+// Int8 GEMM ------------------------------------------------------------------
+
+/*
+ * qgemm computes C = epilogue(A * B) for an m x k uint8_t matrix A (the
+ * im2col patches, row-major) and a k x n int8_t matrix B (the quantized
+ * filters of a qlayer_t), accumulating in int32. Like gemm, the work is split
+ * into QGEMM_MR x QGEMM_NR register tiles, one vector of int32 sums per row.
+ * B is packed into panels of QGEMM_NR columns, in groups of 4 values of k:
+ * each group is one 32 byte vector, 4 consecutive k of the first column,
+ * then of the second, and so on. A kernel broadcasts 4 bytes of a row of A
+ * and multiplies them with such a vector, which adds 4 products into every
+ * int32 sum at once:
+ *
+ *  - AVX512-VNNI does this in one instruction (vpdpbusd).
+ *  - AVX2 multiplies the bytes into pairs of int16 sums (vpmaddubsw) and
+ *    adds the pairs into int32 (vpmaddwd with ones). The int16 sums can't
+ *    saturate, since A is at most 127 (2 * 127 * 127 < 32768).
+ *  - Without AVX2, the same is done with 16 byte vectors, 4 rows at a time,
+ *    and SSE2 (without vpmaddubsw) multiplies the even and odd bytes apart.
+ *  - CNN_ISA=scalar runs a plain C kernel, to compare the others against.
+ *
+ * Every result is exact, so all kernels give the same output. The largest k
+ * is a few hundred, so a tile of A and a panel of B stay in L1 without
+ * blocking k. The epilogue scales the int32 sums of every output channel to
+ * the output scale and adds its bias, and either stores them as floats or
+ * rounds them to [0, 127] (relu) and stores them as bytes.
+ *
+ * A has to have whole tiles (m rounded up to QGEMM_MR rows), which only the
+ * first m are stored of.
+ */
+
+#define QGEMM_MR 8
+#define QGEMM_NR 8
+
+enum { QISA_SCALAR, QISA_SSE2, QISA_AVX, QISA_AVX2, QISA_VNNI };
+
+// The qgemm kernels to use, see qgemm_select.
+static int q_isa = -1;
+
+static int qgemm_panels(int n) {
+  return (n + QGEMM_NR - 1) / QGEMM_NR;
+}
+
+/*
+ * Pick the kernels that fit the selected (float) kernels of isa.c, so that
+ * CNN_ISA limits both.
+ */
+
+static void qgemm_select(void) {
+  int level = cnn_kernels()->level;
+  __builtin_cpu_init();
+  if (level >= ISA_AVX512 && __builtin_cpu_supports("avx512vnni") &&
+      __builtin_cpu_supports("avx512vl"))
+    q_isa = QISA_VNNI;
+  else if (level >= ISA_AVX2)
+    q_isa = QISA_AVX2;
+  else if (level >= ISA_AVX)
+    q_isa = QISA_AVX;
+  else if (level >= ISA_SSE2)
+    q_isa = QISA_SSE2;
+  else
+    q_isa = QISA_SCALAR;
+}
+
+/*
+ * Pack the quantized filters w (out_depth x kp, row-major) into q->w.
+ */
+
+static void qgemm_pack(qlayer_t* q, const int8_t* w) {
+  int kp = q->kp;
+  q->w = (int8_t*)_mm_malloc(qgemm_panels(q->out_depth) * QGEMM_NR * kp, 64);
+  for (int j = 0; j < qgemm_panels(q->out_depth) * QGEMM_NR; j++) {
+    int8_t* panel = q->w + (j / QGEMM_NR) * QGEMM_NR * kp + (j % QGEMM_NR) * 4;
+    for (int p = 0; p < kp; p++)
+      panel[(p / 4) * QGEMM_NR * 4 + p % 4] = (j < q->out_depth) ? w[j * kp + p] : 0;
+  }
+}
+
+static inline int32_t qload4(const uint8_t* p) {
+  int32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/*
+ * Epilogue of one output value.
+ */
+
+static inline void qstore1(const qlayer_t* q, int j, int32_t acc, void* c) {
+  float y = acc * q->mult[j] + q->add[j];
+  if (q->out_float) {
+    *(float*)c = y;
+  } else {
+    y = (y > 0.0f) ? y : 0.0f;
+    y = (y < 127.0f) ? y : 127.0f;
+    *(uint8_t*)c = (uint8_t)lrintf(y);
+  }
+}
+
+static void qkernel_scalar(const qlayer_t* q, int mr, int nr, const uint8_t* a, int lda,
+                           const int8_t* b, int jc, void* c, int ldc) {
+  for (int i = 0; i < mr; i++)
+    for (int j = 0; j < nr; j++) {
+      int32_t acc = 0;
+      for (int p = 0; p < q->kp; p += 4)
+        for (int t = 0; t < 4; t++)
+          acc += a[i * lda + p + t] * b[p * QGEMM_NR + j * 4 + t];
+      if (q->out_float)
+        qstore1(q, jc + j, acc, (float*)c + i * ldc + j);
+      else
+        qstore1(q, jc + j, acc, (uint8_t*)c + i * ldc + j);
+    }
+}
+
+/*
+ * Epilogue of 4 output channels (j to j+3) of a row.
+ */
+
+static inline void qstore4(const qlayer_t* q, int j, int nr, __m128i acc, void* c) {
+  __m128 y = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(acc), _mm_loadu_ps(q->mult + j)),
+                        _mm_loadu_ps(q->add + j));
+  if (q->out_float) {
+    float tmp[4];
+    _mm_storeu_ps(tmp, y);
+    memcpy(c, tmp, sizeof(float) * nr);
+  } else {
+    y = _mm_min_ps(_mm_max_ps(y, _mm_setzero_ps()), _mm_set1_ps(127.0f));
+    __m128i r = _mm_cvtps_epi32(y);
+    r = _mm_packus_epi16(_mm_packs_epi32(r, r), r);
+    int32_t bytes = _mm_cvtsi128_si32(r);
+    memcpy(c, &bytes, nr);
+  }
+}
+
+/*
+ * 4 rows with 16 byte vectors, two per row of a tile. maddubs is
+ * _mm_maddubs_epi16, which SSE2 doesn't have (see qmaddubs_sse2).
+ */
+
+#define QKERNEL_ROWS(maddubs)                                                           \
+  __m128i ones = _mm_set1_epi16(1);                                                    \
+  __m128i c00 = _mm_setzero_si128(), c01 = c00, c10 = c00, c11 = c00;                  \
+  __m128i c20 = c00, c21 = c00, c30 = c00, c31 = c00;                                  \
+                                                                                       \
+  for (int p = 0; p < q->kp; p += 4) {                                                 \
+    __m128i b0 = _mm_load_si128((const __m128i*)(b + p * QGEMM_NR));                   \
+    __m128i b1 = _mm_load_si128((const __m128i*)(b + p * QGEMM_NR + 16));              \
+    __m128i a0 = _mm_set1_epi32(qload4(a + 0*lda + p));                                \
+    __m128i a1 = _mm_set1_epi32(qload4(a + 1*lda + p));                                \
+    __m128i a2 = _mm_set1_epi32(qload4(a + 2*lda + p));                                \
+    __m128i a3 = _mm_set1_epi32(qload4(a + 3*lda + p));                                \
+    c00 = _mm_add_epi32(c00, _mm_madd_epi16(maddubs(a0, b0), ones));                   \
+    c01 = _mm_add_epi32(c01, _mm_madd_epi16(maddubs(a0, b1), ones));                   \
+    c10 = _mm_add_epi32(c10, _mm_madd_epi16(maddubs(a1, b0), ones));                   \
+    c11 = _mm_add_epi32(c11, _mm_madd_epi16(maddubs(a1, b1), ones));                   \
+    c20 = _mm_add_epi32(c20, _mm_madd_epi16(maddubs(a2, b0), ones));                   \
+    c21 = _mm_add_epi32(c21, _mm_madd_epi16(maddubs(a2, b1), ones));                   \
+    c30 = _mm_add_epi32(c30, _mm_madd_epi16(maddubs(a3, b0), ones));                   \
+    c31 = _mm_add_epi32(c31, _mm_madd_epi16(maddubs(a3, b1), ones));                   \
+  }                                                                                    \
+                                                                                       \
+  __m128i acc[8] = { c00, c01, c10, c11, c20, c21, c30, c31 };                         \
+  size_t size = q->out_float ? sizeof(float) : 1;                                      \
+  for (int i = 0; i < mr; i++) {                                                       \
+    char* row = (char*)c + i * ldc * size;                                             \
+    qstore4(q, jc, (nr < 4) ? nr : 4, acc[2*i], row);                                  \
+    if (nr > 4)                                                                        \
+      qstore4(q, jc + 4, nr - 4, acc[2*i + 1], row + 4 * size);                        \
+  }
+
+/*
+ * _mm_maddubs_epi16 in SSE2: the products of the even and the odd bytes,
+ * added. Our sums never saturate (see above).
+ */
+
+static inline __m128i qmaddubs_sse2(__m128i a, __m128i b) {
+  __m128i mask = _mm_set1_epi16(0xff);
+  __m128i even = _mm_mullo_epi16(_mm_and_si128(a, mask), _mm_srai_epi16(_mm_slli_epi16(b, 8), 8));
+  __m128i odd = _mm_mullo_epi16(_mm_srli_epi16(a, 8), _mm_srai_epi16(b, 8));
+  return _mm_add_epi16(even, odd);
+}
+
+static void qkernel_sse2_rows(const qlayer_t* q, int mr, int nr, const uint8_t* a, int lda,
+                              const int8_t* b, int jc, void* c, int ldc) {
+  QKERNEL_ROWS(qmaddubs_sse2)
+}
+
+__attribute__((target("avx")))
+static void qkernel_avx_rows(const qlayer_t* q, int mr, int nr, const uint8_t* a, int lda,
+                             const int8_t* b, int jc, void* c, int ldc) {
+  QKERNEL_ROWS(_mm_maddubs_epi16)
+}
+
+#undef QKERNEL_ROWS
+
+static void qkernel_sse2(const qlayer_t* q, int mr, int nr, const uint8_t* a, int lda,
+                         const int8_t* b, int jc, void* c, int ldc) {
+  size_t size = q->out_float ? sizeof(float) : 1;
+  qkernel_sse2_rows(q, (mr < 4) ? mr : 4, nr, a, lda, b, jc, c, ldc);
+  if (mr > 4)
+    qkernel_sse2_rows(q, mr - 4, nr, a + 4 * lda, lda, b, jc, (char*)c + 4 * ldc * size, ldc);
+}
+
+__attribute__((target("avx")))
+static void qkernel_avx(const qlayer_t* q, int mr, int nr, const uint8_t* a, int lda,
+                        const int8_t* b, int jc, void* c, int ldc) {
+  size_t size = q->out_float ? sizeof(float) : 1;
+  qkernel_avx_rows(q, (mr < 4) ? mr : 4, nr, a, lda, b, jc, c, ldc);
+  if (mr > 4)
+    qkernel_avx_rows(q, mr - 4, nr, a + 4 * lda, lda, b, jc, (char*)c + 4 * ldc * size, ldc);
+}
+
+/*
+ * Epilogue of the QGEMM_NR output channels (jc on) of a row.
+ */
+
+__attribute__((target("avx2")))
+static inline void qstore8_avx2(const qlayer_t* q, int jc, int nr, __m256i acc, void* c) {
+  __m256 y = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(acc), _mm256_loadu_ps(q->mult + jc)),
+                           _mm256_loadu_ps(q->add + jc));
+  if (q->out_float) {
+    float tmp[8];
+    _mm256_storeu_ps(tmp, y);
+    memcpy(c, tmp, sizeof(float) * nr);
+  } else {
+    y = _mm256_min_ps(_mm256_max_ps(y, _mm256_setzero_ps()), _mm256_set1_ps(127.0f));
+    __m256i r = _mm256_cvtps_epi32(y);
+    __m128i h = _mm_packs_epi32(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1));
+    h = _mm_packus_epi16(h, h);
+    if (nr == QGEMM_NR) {
+      _mm_storel_epi64((__m128i*)c, h);
+    } else {
+      uint8_t tmp[16];
+      _mm_storeu_si128((__m128i*)tmp, h);
+      memcpy(c, tmp, nr);
+    }
+  }
+}
+
+__attribute__((target("avx2")))
+static inline void qstore_tile_avx2(const qlayer_t* q, int mr, int nr, int jc, void* c, int ldc,
+                             __m256i c0, __m256i c1, __m256i c2, __m256i c3,
+                             __m256i c4, __m256i c5, __m256i c6, __m256i c7) {
+  __m256i acc[QGEMM_MR] = { c0, c1, c2, c3, c4, c5, c6, c7 };
+  size_t size = q->out_float ? sizeof(float) : 1;
+  for (int i = 0; i < mr; i++)
+    qstore8_avx2(q, jc, nr, acc[i], (char*)c + i * ldc * size);
+}
+
+__attribute__((target("avx2")))
+static void qkernel_avx2(const qlayer_t* q, int mr, int nr, const uint8_t* a, int lda,
+                         const int8_t* b, int jc, void* c, int ldc) {
+  __m256i ones = _mm256_set1_epi16(1);
+  __m256i c0 = _mm256_setzero_si256(), c1 = c0, c2 = c0, c3 = c0;
+  __m256i c4 = c0, c5 = c0, c6 = c0, c7 = c0;
+
+  for (int p = 0; p < q->kp; p += 4) {
+    __m256i bv = _mm256_load_si256((const __m256i*)(b + p * QGEMM_NR));
+#define QSTEP(ci, i) \
+    ci = _mm256_add_epi32(ci, _mm256_madd_epi16( \
+        _mm256_maddubs_epi16(_mm256_set1_epi32(qload4(a + (i)*lda + p)), bv), ones))
+    QSTEP(c0, 0); QSTEP(c1, 1); QSTEP(c2, 2); QSTEP(c3, 3);
+    QSTEP(c4, 4); QSTEP(c5, 5); QSTEP(c6, 6); QSTEP(c7, 7);
+#undef QSTEP
+  }
+  qstore_tile_avx2(q, mr, nr, jc, c, ldc, c0, c1, c2, c3, c4, c5, c6, c7);
+}
+
+__attribute__((target("avx2,avx512vnni,avx512vl")))
+static void qkernel_vnni(const qlayer_t* q, int mr, int nr, const uint8_t* a, int lda,
+                         const int8_t* b, int jc, void* c, int ldc) {
+  __m256i c0 = _mm256_setzero_si256(), c1 = c0, c2 = c0, c3 = c0;
+  __m256i c4 = c0, c5 = c0, c6 = c0, c7 = c0;
+
+  for (int p = 0; p < q->kp; p += 4) {
+    __m256i bv = _mm256_load_si256((const __m256i*)(b + p * QGEMM_NR));
+#define QSTEP(ci, i) \
+    ci = _mm256_dpbusd_epi32(ci, _mm256_set1_epi32(qload4(a + (i)*lda + p)), bv)
+    QSTEP(c0, 0); QSTEP(c1, 1); QSTEP(c2, 2); QSTEP(c3, 3);
+    QSTEP(c4, 4); QSTEP(c5, 5); QSTEP(c6, 6); QSTEP(c7, 7);
+#undef QSTEP
+  }
+  qstore_tile_avx2(q, mr, nr, jc, c, ldc, c0, c1, c2, c3, c4, c5, c6, c7);
+}
+
+/*
+ * C (m x q->out_depth, leading dimension ldc, uint8_t or float) = epilogue(A
+ * (m x q->kp, leading dimension lda) * the weights of q).
+ */
+
+static void qgemm(const qlayer_t* q, int m, const uint8_t* a, int lda, void* c, int ldc) {
+  size_t size = q->out_float ? sizeof(float) : 1;
+  for (int jc = 0; jc < q->out_depth; jc += QGEMM_NR) {
+    int nr = (q->out_depth - jc < QGEMM_NR) ? q->out_depth - jc : QGEMM_NR;
+    const int8_t* b = q->w + jc * q->kp;
+    for (int ic = 0; ic < m; ic += QGEMM_MR) {
+      int mr = (m - ic < QGEMM_MR) ? m - ic : QGEMM_MR;
+      char* ct = (char*)c + (ic * ldc + jc) * size;
+      switch (q_isa) {
+        case QISA_VNNI: qkernel_vnni(q, mr, nr, a + ic * lda, lda, b, jc, ct, ldc); break;
+        case QISA_AVX2: qkernel_avx2(q, mr, nr, a + ic * lda, lda, b, jc, ct, ldc); break;
+        case QISA_AVX: qkernel_avx(q, mr, nr, a + ic * lda, lda, b, jc, ct, ldc); break;
+        case QISA_SSE2: qkernel_sse2(q, mr, nr, a + ic * lda, lda, b, jc, ct, ldc); break;
+        default: qkernel_scalar(q, mr, nr, a + ic * lda, lda, b, jc, ct, ldc); break;
+      }
+    }
+  }
+}
+
+// Quantized Layers -----------------------------------------------------------
+
+/*
+ * Quantize a value to int8 given the inverse of its scale.
+ */
+
+static inline int8_t quantize(float v, float inv_scale, int max) {
+  long q = lrintf(v * inv_scale);
+  return (int8_t)(q > max ? max : (q < -max ? -max : q));
+}
+
+/*
+ * Quantize the out_depth filters (each with k weights) of a layer, whose
+ * inputs are quantized with in_scale and in_zero. The outputs are quantized
+ * with out_scale, or are floats if out_float.
+ */
+
+static void make_qlayer(qlayer_t* q, vol_t** filters, vol_t* biases, int out_depth, int k,
+                        float in_scale, int in_zero, float out_scale, int out_float) {
+  int np = qgemm_panels(out_depth) * QGEMM_NR;
+
+  q->out_depth = out_depth;
+  q->k = k;
+  q->kp = (k + 3) & ~3;
+  q->mult = (float*)calloc(np, sizeof(float));
+  q->add = (float*)calloc(np, sizeof(float));
+  q->out_float = out_float;
+
+  int8_t* w = (int8_t*)calloc((size_t)out_depth * q->kp, 1);
+  for (int d = 0; d < out_depth; d++) {
+    double wmax = 0.0;
+    for (int i = 0; i < k; i++)
+      if (fabs(filters[d]->w[i]) > wmax) wmax = fabs(filters[d]->w[i]);
+    float ws = (wmax > 0.0) ? wmax / 127.0 : 1.0;
+
+    // The zero point adds in_zero * (sum of the weights) to every output.
+    int32_t sum = 0;
+    for (int i = 0; i < k; i++) {
+      w[d * q->kp + i] = quantize(filters[d]->w[i], 1.0f / ws, 127);
+      sum += w[d * q->kp + i];
+    }
+    q->mult[d] = in_scale * ws / out_scale;
+    q->add[d] = (biases->w[d] - in_scale * ws * in_zero * sum) / out_scale;
+  }
+  qgemm_pack(q, w);
+  free(w);
+}
+
+static void free_qlayer(qlayer_t* q) {
+  _mm_free(q->w);
+  free(q->mult);
+  free(q->add);
+}
+
+/*
+ * Quantized convolution of a uint8_t volume with a halo of l->pad (see
+ * qnet_t) into a uint8_t volume with the output scale of q, relu applied.
+ * im2col runs for QCONV_MC output pixels at a time, like conv_forward.
+ */
+
+#define QCONV_MC 32
+
+static void qconv_forward(conv_layer_t* l, qlayer_t* q, const uint8_t* in, uint8_t* out,
+                          uint8_t* col) {
+  int psx = l->in_sx + 2 * l->pad;
+  int row = l->sx * l->in_depth;
+  int P = l->out_sx * l->out_sy;
+
+  for (int p0 = 0; p0 < P; p0 += QCONV_MC) {
+    int m = (P - p0 < QCONV_MC) ? P - p0 : QCONV_MC;
+    for (int i = 0; i < m; i++) {
+      int ay = (p0 + i) / l->out_sx;
+      int ax = (p0 + i) % l->out_sx;
+      const uint8_t* src = in + (ay * l->stride * psx + ax * l->stride) * l->in_depth;
+      uint8_t* dst = col + i * q->kp;
+      for (int fy = 0; fy < l->sy; fy++)
+        memcpy(dst + fy * row, src + fy * psx * l->in_depth, row);
+    }
+    qgemm(q, m, col, q->kp, out + p0 * q->out_depth, q->out_depth);
+  }
+}
+
+/*
+ * Max pooling of a uint8_t volume into the inside of a volume with a halo of
+ * pad. All values are >= 0 (after relu).
+ */
+
+static void qpool_forward(pool_layer_t* l, const uint8_t* in, uint8_t* out, int pad) {
+  int D = l->out_depth;
+  int psx = l->out_sx + 2 * pad;
+  for (int ay = 0; ay < l->out_sy; ay++)
+    for (int ax = 0; ax < l->out_sx; ax++) {
+      uint8_t* dst = out + ((ay + pad) * psx + ax + pad) * D;
+      memset(dst, 0, D);
+      for (int fy = 0; fy < l->sy; fy++)
+        for (int fx = 0; fx < l->sx; fx++) {
+          int oy = ay * l->stride + fy;
+          int ox = ax * l->stride + fx;
+          if (oy < l->in_sy && ox < l->in_sx) {
+            const uint8_t* src = in + ((l->in_sx * oy) + ox) * D;
+            for (int d = 0; d < D; d++)
+              dst[d] = (src[d] > dst[d]) ? src[d] : dst[d];
+          }
+        }
+    }
+}
+
+// Quantized Network ----------------------------------------------------------
+
+/*
+ * Bytes of the input of conv layer l, with its halo.
+ */
+
+static size_t qconv_in_size(conv_layer_t* l) {
+  return (size_t)(l->in_sx + 2 * l->pad) * (l->in_sy + 2 * l->pad) * l->in_depth;
+}
+
+/*
+ * Lay out the buffers of a worker in its scratch memory (NULL to only count
+ * them). Returns the bytes needed.
+ */
+
+static uint8_t* qtake(uint8_t* base, size_t* offset, size_t size) {
+  uint8_t* p = (base != NULL) ? base + *offset : NULL;
+  *offset += (size + 63) & ~(size_t)63;
+  return p;
+}
+
+static size_t qnet_buffers(qnet_t* q, uint8_t* base, qbuffers_t* bufs) {
+  network_t* net = q->net;
+  conv_layer_t* convs[3] = { net->l0, net->l3, net->l6 };
+  size_t offset = 0;
+  size_t out = 0, col = 0;
+  for (int c = 0; c < 3; c++) {
+    bufs->in[c] = qtake(base, &offset, qconv_in_size(convs[c]));
+    size_t size = (size_t)convs[c]->out_sx * convs[c]->out_sy * convs[c]->out_depth;
+    out = (size > out) ? size : out;
+    col = ((size_t)q->conv[c].kp > col) ? q->conv[c].kp : col;
+  }
+  bufs->out = qtake(base, &offset, out);
+  bufs->fc = qtake(base, &offset, (size_t)QGEMM_MR * q->fc.kp);
+  bufs->col = qtake(base, &offset, QCONV_MC * col);
+  bufs->logits = (float*)qtake(base, &offset,
+                               sizeof(float) * qgemm_panels(q->fc.out_depth) * QGEMM_NR);
+  return offset;
+}
+
+/*
+ * Allocate a scratch for each of n workers. Only the insides of the conv
+ * inputs are written per image, so their halos are filled in here.
+ */
+
+static void qnet_alloc_scratch(qnet_t* q, int n) {
+  network_t* net = q->net;
+  qbuffers_t bufs;
+  size_t size = qnet_buffers(q, NULL, &bufs);
+  q->num_scratch = n;
+  q->scratch = (uint8_t**)malloc(sizeof(uint8_t*) * n);
+  for (int i = 0; i < n; i++) {
+    q->scratch[i] = (uint8_t*)_mm_malloc(size, 64);
+    memset(q->scratch[i], 0, size);
+    qnet_buffers(q, q->scratch[i], &bufs);
+    memset(bufs.in[0], q->in_zero, qconv_in_size(net->l0));
+  }
+}
+
+/*
+ * Build the quantized version of net, calibrating the activation ranges on
+ * the n raw images in calib.
+ */
+
+qnet_t* make_qnet(network_t* net, const uint8_t** calib, int n) {
+  // Calibration needs the conv outputs, which fused networks don't keep.
+  assert(!(net->flags & NET_FUSED));
+
+  qnet_t* q = (qnet_t*)malloc(sizeof(qnet_t));
+  q->net = net;
+
+  if (q_isa < 0)
+    qgemm_select();
+
+  // Calibration: track the range of the input and of the three conv outputs.
+  // The input is a function of the raw bytes, so its range comes from them.
+  const int observed[3] = { 1, 4, 7 };
+  double range[4] = { 0.0 };
+  int pixels = net->v[0]->sx * net->v[0]->sy * net->v[0]->depth;
+
+  // The conv outputs have to survive net_forward, so don't share memory.
+  mem_plan_t keep_all;
+  plan_memory(net, 1, &keep_all);
+  batch_t* batch = make_batch_plan(net, 1, &keep_all);
+  for (int i = 0; i < n; i++) {
+    for (int e = 0; e < pixels; e++)
+      if (fabs(pixel_norm[calib[i][e]]) > range[0]) range[0] = fabs(pixel_norm[calib[i][e]]);
+
+    image_to_vol(batch[0][0], calib[i]);
+    net_forward(net, batch, 0, 0);
+    for (int j = 0; j < 3; j++) {
+      vol_t* v = batch[observed[j]][0];
+      for (int y = 0; y < v->sy; y++)
+        for (int e = 0; e < v->sx * v->depth; e++) {
+          real_t x = v->w[v->ystride * y + e];
+          if (fabs(x) > range[j+1]) range[j+1] = fabs(x);
+        }
+    }
+  }
+  free_batch(batch, 1);
+
+  // The input has 7 bits, see above.
+  float scale[4];
+  for (int j = 0; j < 4; j++)
+    scale[j] = (range[j] > 0.0) ? range[j] / ((j == 0) ? 63.0 : 127.0) : 1.0;
+
+  q->in_scale = scale[0];
+  q->in_zero = 64;
+  for (int p = 0; p < 256; p++)
+    q->in_lut[p] = quantize(pixel_norm[p], 1.0f / q->in_scale, 63) + q->in_zero;
+
+  conv_layer_t* convs[3] = { net->l0, net->l3, net->l6 };
+  for (int c = 0; c < 3; c++) {
+    conv_layer_t* l = convs[c];
+    make_qlayer(&q->conv[c], l->filters, l->biases, l->out_depth,
+                l->sx * l->sy * l->in_depth, scale[c], (c == 0) ? q->in_zero : 0,
+                scale[c+1], 0);
+  }
+
+  // The fc input is the pooled relu output of the last conv layer, which
+  // has the same scale as that conv output. Its outputs stay in float.
+  make_qlayer(&q->fc, net->l9->filters, net->l9->biases, net->l9->out_depth,
+              net->l9->num_inputs, scale[3], 0, 1.0f, 1);
+
+  qnet_alloc_scratch(q, sched_max_workers());
+  return q;
+}
+
+void free_qnet(qnet_t* q) {
+  for (int c = 0; c < 3; c++)
+    free_qlayer(&q->conv[c]);
+  free_qlayer(&q->fc);
+  for (int i = 0; i < q->num_scratch; i++)
+    _mm_free(q->scratch[i]);
+  free(q->scratch);
+  free(q);
+}
+
+/*
+ * Run one raw image (see image_to_vol) through the quantized network, using
+ * the given scratch (of q->scratch). out receives the softmax probabilities
+ * (a 1x1x10 volume).
+ */
+
+void qnet_forward(qnet_t* q, const uint8_t* img, vol_t* out, uint8_t* scratch) {
+  network_t* net = q->net;
+  conv_layer_t* convs[3] = { net->l0, net->l3, net->l6 };
+  pool_layer_t* pools[3] = { net->l2, net->l5, net->l8 };
+  qbuffers_t bufs;
+  qnet_buffers(q, scratch, &bufs);
+
+  // The image is stored plane by plane, the volume pixel by pixel.
+  conv_layer_t* l0 = net->l0;
+  int plane = l0->in_sx * l0->in_sy;
+  int psx = l0->in_sx + 2 * l0->pad;
+  for (int y = 0; y < l0->in_sy; y++) {
+    uint8_t* dst = bufs.in[0] + ((y + l0->pad) * psx + l0->pad) * l0->in_depth;
+    const uint8_t* src = img + l0->in_sx * y;
+    for (int x = 0; x < l0->in_sx; x++)
+      for (int d = 0; d < l0->in_depth; d++)
+        dst[x * l0->in_depth + d] = q->in_lut[src[x + d * plane]];
+  }
+
+  for (int c = 0; c < 3; c++) {
+    qconv_forward(convs[c], &q->conv[c], bufs.in[c], bufs.out, bufs.col);
+    if (c < 2)
+      qpool_forward(pools[c], bufs.out, bufs.in[c+1], convs[c+1]->pad);
+    else
+      qpool_forward(pools[c], bufs.out, bufs.fc, 0);
+  }
+
+  // fc: the pooled volume is the im2col row of the single output pixel.
+  qlayer_t* fc = &q->fc;
+  qgemm(fc, 1, bufs.fc, fc->kp, bufs.logits, fc->out_depth);
+
+  real_t logits_w[fc->out_depth];
+  vol_t logits = { 1, 1, fc->out_depth, logits_w, 0, fc->out_depth, 0 };
+  for (int d = 0; d < fc->out_depth; d++)
+    logits_w[d] = bufs.logits[d];
+
+  vol_t* lp = &logits;
+  softmax_forward(net->l10, &lp, &out, 0, 0);
+}
+
+/*
+ * Quantized counterpart of net_classify_images, one task per image.
+ */
+
+typedef struct qclassify_job {
+  qnet_t* q;
+  const uint8_t** input;
+  double* output;
+} qclassify_job_t;
+
+static void qclassify_image(void* ctx, int i, int worker) {
+  qclassify_job_t* job = (qclassify_job_t*)ctx;
+  qnet_t* q = job->q;
+  real_t probs_w[q->fc.out_depth];
+  vol_t probs = { 1, 1, q->fc.out_depth, probs_w, 0, q->fc.out_depth, 0 };
+  uint64_t t0 = trace_begin();
+  qnet_forward(q, job->input[i], &probs, q->scratch[worker]);
+  job->output[i] = probs_w[CAT_LABEL];
+  trace_end("image", -1, "index", i, t0);
+}
+
+void qnet_classify_images(qnet_t* q, const uint8_t** input, double* output, int n) {
+  assert(sched_num_workers() <= q->num_scratch);
+  qclassify_job_t job = { q, input, output };
+  sched_parallel_for(n, 1, qclassify_image, &job);
+}
@@ -0,0 +1,79 @@
+// Reference kernels ----------------------------------------------------------
+
+/*
+ * The unoptimized kernels of cnnstart.c, behind a small interface of plain
+ * arrays for the A/B harness (see abtest.c). This file is compiled on its
+ * own, and all symbols except the ref_ ones are made local with objcopy (see
+ * the Makefile), so the two implementations of conv_forward, vol_t and so on
+ * can be linked into one binary.
+ *
+ * Volumes are passed as dense arrays of doubles in the layout of cnnstart.c,
+ * ((sx * y) + x) * depth + d, one image after the other.
+ */
+
+#define CNN_NO_MAIN
+#include "cnnstart.c"
+
+/*
+ * The reference network with the weights of the text snapshot. Must be
+ * called from the test directory, like ../cnn.
+ */
+
+void* ref_load_network(void) {
+  network_t* net = make_network();
+  conv_load(net->l0, "../data/snapshot/layer1_conv.txt");
+  conv_load(net->l3, "../data/snapshot/layer4_conv.txt");
+  conv_load(net->l6, "../data/snapshot/layer7_conv.txt");
+  fc_load(net->l9, "../data/snapshot/layer10_fc.txt");
+  return net;
+}
+
+void ref_free_network(void* net) {
+  free_network((network_t*)net);
+}
+
+/*
+ * Run layer of the network on n images, from in into out, and return the
+ * time spent in the _forward function in ns.
+ */
+
+uint64_t ref_layer_forward(void* ref, int layer, const double* in, double* out, int n) {
+  network_t* net = (network_t*)ref;
+  vol_t* vin = net->v[layer];
+  vol_t* vout = net->v[layer+1];
+  size_t in_size = vin->sx * vin->sy * vin->depth;
+  size_t out_size = vout->sx * vout->sy * vout->depth;
+
+  vol_t** ins = (vol_t**)malloc(sizeof(vol_t*) * n);
+  vol_t** outs = (vol_t**)malloc(sizeof(vol_t*) * n);
+  for (int j = 0; j < n; j++) {
+    ins[j] = make_vol(vin->sx, vin->sy, vin->depth, 0.0);
+    memcpy(ins[j]->w, in + j * in_size, sizeof(double) * in_size);
+    outs[j] = make_vol(vout->sx, vout->sy, vout->depth, 0.0);
+  }
+
+  uint64_t t0 = timestamp_ns();
+  switch (layer) {
+    case 0: conv_forward(net->l0, ins, outs, 0, n - 1); break;
+    case 1: relu_forward(net->l1, ins, outs, 0, n - 1); break;
+    case 2: pool_forward(net->l2, ins, outs, 0, n - 1); break;
+    case 3: conv_forward(net->l3, ins, outs, 0, n - 1); break;
+    case 4: relu_forward(net->l4, ins, outs, 0, n - 1); break;
+    case 5: pool_forward(net->l5, ins, outs, 0, n - 1); break;
+    case 6: conv_forward(net->l6, ins, outs, 0, n - 1); break;
+    case 7: relu_forward(net->l7, ins, outs, 0, n - 1); break;
+    case 8: pool_forward(net->l8, ins, outs, 0, n - 1); break;
+    case 9: fc_forward(net->l9, ins, outs, 0, n - 1); break;
+    case 10: softmax_forward(net->l10, ins, outs, 0, n - 1); break;
+  }
+  uint64_t t1 = timestamp_ns();
+
+  for (int j = 0; j < n; j++) {
+    memcpy(out + j * out_size, outs[j]->w, sizeof(double) * out_size);
+    free_vol(ins[j]);
+    free_vol(outs[j]);
+  }
+  free(ins);
+  free(outs);
+  return t1 - t0;
+}
@@ -0,0 +1,420 @@
+// Scheduler ------------------------------------------------------------------
+
+/*
+ * A work-stealing task scheduler for the parallel loops of the network. It
+ * owns one worker thread per CPU (CNN_THREADS overrides the count), each
+ * pinned to its CPU unless CNN_PIN=0. The pool is started on first use and
+ * lives as long as the process.
+ *
+ * sched_parallel_for(n, grain, fn, ctx) calls fn(ctx, i, worker) for all
+ * 0 <= i < n and returns when all calls are done. The range is a task that
+ * splits itself in halves down to grain iterations: a worker keeps the left
+ * half and pushes the right half onto the bottom of its deque. Idle workers
+ * steal from the top of the deques of others, which holds the largest
+ * pieces, so the load balances itself at the tail of a loop.
+ *
+ * Loops nest: called from inside a task, the loop is pushed onto the deque of
+ * the calling worker, which then works on it until it is done, while idle
+ * workers steal parts of it. No thread is ever added, so nested loops can't
+ * oversubscribe the CPUs. While it waits, a worker only runs tasks of the
+ * loop it waits for, so fn never runs nested inside an unrelated task on
+ * the same worker. This keeps per-worker state (see net_workspace) safe.
+ *
+ * Called from any other thread, the loop is queued for the workers and the
+ * caller sleeps until it is done.
+ *
+ * sched_set_workers limits the pool to its first n workers (the others
+ * sleep), e.g. to measure how the network scales with the number of cores.
+ */
+
+#define SCHED_MAX_WORKERS 256
+
+typedef void (*sched_fn_t)(void* ctx, int i, int worker);
+
+typedef struct sched_group {
+  int pending;          // iterations not done yet
+  int external;         // an outside thread sleeps on done
+  int finished;         // set under lock when pending drops to 0
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+} sched_group_t;
+
+typedef struct sched_task {
+  sched_fn_t fn;
+  void* ctx;
+  int begin, end, grain;
+  sched_group_t* group;
+  int external;         // copy of group->external, see sched_run
+} sched_task_t;
+
+/*
+ * The owner pushes and pops at the bottom, thieves take from the top. A
+ * mutex is enough here: tasks are whole images or tiles, so the deques are
+ * touched rarely compared to the work in a task.
+ */
+
+typedef struct sched_deque {
+  pthread_mutex_t lock;
+  sched_task_t* tasks;
+  int top, bottom, cap;
+} sched_deque_t;
+
+typedef struct sched_worker {
+  int id;
+  int cpu;              // CPU the worker is pinned to, or -1
+  pthread_t thread;
+  sched_deque_t deque;
+  unsigned int seed;    // for picking victims
+
+  // statistics since sched_reset_stats
+  int depth;            // nesting level of the task being run
+  uint64_t busy_start;
+  uint64_t busy_us;     // CPU time spent in tasks
+  uint64_t tasks;
+  uint64_t steals;
+} sched_worker_t;
+
+typedef struct sched_pool {
+  int num_workers;
+  int active;             // workers [0, active) take tasks
+  sched_worker_t* workers;
+  sched_deque_t inject;   // loops started by outside threads
+
+  int queued;             // tasks in all deques
+  int sleepers;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+
+  uint64_t stats_start;
+} sched_pool_t;
+
+static sched_pool_t* sched_pool = NULL;
+static pthread_mutex_t sched_init_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread sched_worker_t* sched_self = NULL;
+
+static void deque_init(sched_deque_t* q) {
+  pthread_mutex_init(&q->lock, NULL);
+  q->cap = 64;
+  q->tasks = (sched_task_t*)malloc(sizeof(sched_task_t) * q->cap);
+  q->top = 0;
+  q->bottom = 0;
+}
+
+static void deque_push(sched_deque_t* q, sched_task_t* t) {
+  pthread_mutex_lock(&q->lock);
+  if (q->top == q->bottom) {
+    q->top = 0;
+    q->bottom = 0;
+  }
+  if (q->bottom == q->cap) {
+    q->cap *= 2;
+    q->tasks = (sched_task_t*)realloc(q->tasks, sizeof(sched_task_t) * q->cap);
+  }
+  q->tasks[q->bottom++] = *t;
+  pthread_mutex_unlock(&q->lock);
+
+  __atomic_add_fetch(&sched_pool->queued, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&sched_pool->sleepers, __ATOMIC_SEQ_CST) > 0) {
+    // A signal might wake a worker that isn't active, which would go right
+    // back to sleep, so wake them all while the pool is limited.
+    pthread_mutex_lock(&sched_pool->lock);
+    if (sched_pool->active < sched_pool->num_workers)
+      pthread_cond_broadcast(&sched_pool->work);
+    else
+      pthread_cond_signal(&sched_pool->work);
+    pthread_mutex_unlock(&sched_pool->lock);
+  }
+}
+
+/*
+ * Pop the bottom task, but only if it belongs to group (any task if group
+ * is NULL).
+ */
+
+static int deque_pop(sched_deque_t* q, sched_group_t* group, sched_task_t* t) {
+  int found = 0;
+  pthread_mutex_lock(&q->lock);
+  if (q->bottom > q->top && (group == NULL || q->tasks[q->bottom - 1].group == group)) {
+    *t = q->tasks[--q->bottom];
+    found = 1;
+  }
+  pthread_mutex_unlock(&q->lock);
+  if (found)
+    __atomic_sub_fetch(&sched_pool->queued, 1, __ATOMIC_SEQ_CST);
+  return found;
+}
+
+static int deque_steal(sched_deque_t* q, sched_task_t* t) {
+  int found = 0;
+  pthread_mutex_lock(&q->lock);
+  if (q->bottom > q->top) {
+    *t = q->tasks[q->top++];
+    found = 1;
+  }
+  pthread_mutex_unlock(&q->lock);
+  if (found)
+    __atomic_sub_fetch(&sched_pool->queued, 1, __ATOMIC_SEQ_CST);
+  return found;
+}
+
+/*
+ * CPU time of the calling thread in us. Tasks can block (the consumers of
+ * pipeline.c wait for the producers), which must not count as busy.
+ */
+
+static uint64_t sched_cpu_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return 1000000L * ts.tv_sec + ts.tv_nsec / 1000;
+}
+
+/*
+ * Run a task on worker w, splitting off right halves for others to steal.
+ */
+
+static void sched_run(sched_worker_t* w, sched_task_t t) {
+  while (t.end - t.begin > t.grain) {
+    sched_task_t right = t;
+    right.begin = t.begin + (t.end - t.begin) / 2;
+    t.end = right.begin;
+    deque_push(&w->deque, &right);
+  }
+
+  if (w->depth++ == 0)
+    w->busy_start = sched_cpu_us();
+  for (int i = t.begin; i < t.end; i++)
+    t.fn(t.ctx, i, w->id);
+  if (--w->depth == 0)
+    w->busy_us += sched_cpu_us() - w->busy_start;
+  w->tasks++;
+
+  // A nested loop's group lives in the frame of its owner, which returns as
+  // soon as pending drops to 0, so g must not be touched after that. Only an
+  // outside thread waits until finished is set.
+  sched_group_t* g = t.group;
+  if (__atomic_sub_fetch(&g->pending, t.end - t.begin, __ATOMIC_SEQ_CST) == 0 && t.external) {
+    pthread_mutex_lock(&g->lock);
+    g->finished = 1;
+    pthread_cond_signal(&g->done);
+    pthread_mutex_unlock(&g->lock);
+  }
+}
+
+/*
+ * Find a task for an idle worker: its own deque first, then the loops of
+ * outside threads, then the other workers starting at a random one.
+ */
+
+static int sched_find(sched_worker_t* w, sched_task_t* t) {
+  if (w->id >= __atomic_load_n(&sched_pool->active, __ATOMIC_SEQ_CST))
+    return 0;
+  if (deque_pop(&w->deque, NULL, t))
+    return 1;
+  if (deque_steal(&sched_pool->inject, t)) {
+    w->steals++;
+    return 1;
+  }
+  int n = sched_pool->num_workers;
+  int start = rand_r(&w->seed) % n;
+  for (int i = 0; i < n; i++) {
+    sched_worker_t* v = &sched_pool->workers[(start + i) % n];
+    if (v != w && deque_steal(&v->deque, t)) {
+      w->steals++;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void* sched_worker_main(void* arg) {
+  sched_worker_t* w = (sched_worker_t*)arg;
+  sched_self = w;
+
+  if (w->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+
+  sched_task_t t;
+  for (;;) {
+    if (sched_find(w, &t)) {
+      // The pool may have shrunk while the task was stolen.
+      if (w->id >= __atomic_load_n(&sched_pool->active, __ATOMIC_SEQ_CST))
+        deque_push(&sched_pool->inject, &t);
+      else
+        sched_run(w, t);
+      continue;
+    }
+
+    pthread_mutex_lock(&sched_pool->lock);
+    __atomic_add_fetch(&sched_pool->sleepers, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&sched_pool->queued, __ATOMIC_SEQ_CST) == 0 ||
+           w->id >= __atomic_load_n(&sched_pool->active, __ATOMIC_SEQ_CST))
+      pthread_cond_wait(&sched_pool->work, &sched_pool->lock);
+    __atomic_sub_fetch(&sched_pool->sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&sched_pool->lock);
+  }
+  return NULL;
+}
+
+/*
+ * Start the pool if it isn't running yet.
+ */
+
+static sched_pool_t* sched_start(void) {
+  pthread_mutex_lock(&sched_init_lock);
+  if (sched_pool != NULL) {
+    pthread_mutex_unlock(&sched_init_lock);
+    return sched_pool;
+  }
+
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    CPU_SET(0, &allowed);
+  int cpus[CPU_SETSIZE];
+  int num_cpus = 0;
+  for (int c = 0; c < CPU_SETSIZE; c++)
+    if (CPU_ISSET(c, &allowed))
+      cpus[num_cpus++] = c;
+
+  int n = num_cpus;
+  const char* env = getenv("CNN_THREADS");
+  if (env != NULL && atoi(env) > 0)
+    n = atoi(env);
+  if (n > SCHED_MAX_WORKERS)
+    n = SCHED_MAX_WORKERS;
+  env = getenv("CNN_PIN");
+  int pin = (env == NULL || atoi(env) != 0);
+
+  sched_pool_t* p = (sched_pool_t*)malloc(sizeof(sched_pool_t));
+  p->num_workers = n;
+  p->active = n;
+  p->workers = (sched_worker_t*)calloc(n, sizeof(sched_worker_t));
+  deque_init(&p->inject);
+  p->queued = 0;
+  p->sleepers = 0;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->work, NULL);
+  p->stats_start = timestamp_us();
+  sched_pool = p;
+
+  for (int i = 0; i < n; i++) {
+    sched_worker_t* w = &p->workers[i];
+    w->id = i;
+    w->cpu = pin ? cpus[i % num_cpus] : -1;
+    w->seed = i + 1;
+    deque_init(&w->deque);
+    pthread_create(&w->thread, NULL, sched_worker_main, w);
+  }
+
+  pthread_mutex_unlock(&sched_init_lock);
+  return p;
+}
+
+/*
+ * The number of workers that take tasks, and the worker ids are below it.
+ */
+
+int sched_num_workers(void) {
+  return __atomic_load_n(&sched_start()->active, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * The number of workers the pool was started with.
+ */
+
+int sched_max_workers(void) {
+  return sched_start()->num_workers;
+}
+
+/*
+ * Let only the first n workers (at least one, at most all) take tasks. Must
+ * not be called while a loop is running.
+ */
+
+void sched_set_workers(int n) {
+  sched_pool_t* p = sched_start();
+  if (n < 1)
+    n = 1;
+  if (n > p->num_workers)
+    n = p->num_workers;
+  pthread_mutex_lock(&p->lock);
+  __atomic_store_n(&p->active, n, __ATOMIC_SEQ_CST);
+  pthread_cond_broadcast(&p->work);
+  pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * The id of the worker running the caller, or -1 outside of the workers.
+ */
+
+int sched_worker_id(void) {
+  return (sched_self != NULL) ? sched_self->id : -1;
+}
+
+void sched_parallel_for(int n, int grain, sched_fn_t fn, void* ctx) {
+  if (n <= 0)
+    return;
+  sched_start();
+
+  sched_group_t g;
+  g.pending = n;
+  g.external = (sched_self == NULL);
+  g.finished = 0;
+  sched_task_t t = { fn, ctx, 0, n, (grain > 0) ? grain : 1, &g, g.external };
+
+  // Inside a worker: work on the loop until it's done.
+  if (sched_self != NULL) {
+    sched_worker_t* w = sched_self;
+    sched_run(w, t);
+    while (__atomic_load_n(&g.pending, __ATOMIC_SEQ_CST) > 0) {
+      if (deque_pop(&w->deque, &g, &t))
+        sched_run(w, t);
+      else
+        sched_yield();
+    }
+    return;
+  }
+
+  // Outside: hand the loop to the workers and wait.
+  pthread_mutex_init(&g.lock, NULL);
+  pthread_cond_init(&g.done, NULL);
+  deque_push(&sched_pool->inject, &t);
+  pthread_mutex_lock(&g.lock);
+  while (!g.finished)
+    pthread_cond_wait(&g.done, &g.lock);
+  pthread_mutex_unlock(&g.lock);
+  pthread_cond_destroy(&g.done);
+  pthread_mutex_destroy(&g.lock);
+}
+
+/*
+ * Utilization: the share of the wall time since the last reset that each
+ * worker spent on a CPU running tasks (time blocked inside a task doesn't
+ * count), with the number of tasks it ran and stole.
+ */
+
+void sched_reset_stats(void) {
+  sched_pool_t* p = sched_start();
+  for (int i = 0; i < p->num_workers; i++) {
+    p->workers[i].busy_us = 0;
+    p->workers[i].tasks = 0;
+    p->workers[i].steals = 0;
+  }
+  p->stats_start = timestamp_us();
+}
+
+void sched_print_stats(FILE* f) {
+  sched_pool_t* p = sched_start();
+  double wall = (double)(timestamp_us() - p->stats_start);
+  fprintf(f, "WORKER  CPU   BUSY     TASKS    STEALS\n");
+  for (int i = 0; i < p->num_workers; i++) {
+    sched_worker_t* w = &p->workers[i];
+    fprintf(f, "%6d %4d %6.1f%% %9lu %9lu\n", i, w->cpu,
+            (wall > 0) ? 100.0 * w->busy_us / wall : 0.0,
+            (unsigned long)w->tasks, (unsigned long)w->steals);
+  }
+}
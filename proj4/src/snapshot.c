@@ -0,0 +1,261 @@
+// Binary Snapshot ------------------------------------------------------------
+
+/*
+ * The text snapshot (data/snapshot/layer*.txt) needs one fscanf per weight,
+ * which is most of the start up time of a short run. `cnn convert` writes
+ * the same weights into a single binary file that is mapped into memory
+ * with mmap when the network is loaded.
+ *
+ * The file starts with a snapshot_header_t and then holds, for each of the
+ * conv and fc layers, four 64 byte aligned arrays of real_t:
+ *
+ *   weights      n filters of k values each, in the layout of vol_t
+ *   biases       n values
+ *   packed       the weights as packed by gemm_pack_b (panel wide panels)
+ *   packed_bias  the biases as packed by gemm_pack_bias
+ *
+ * If the panel width of the file matches GEMM_NR of the running kernels,
+ * the layers use the packed weights right from the mapping. Otherwise the
+ * weights are packed again. The precision of the file has to match the
+ * build (the layers keep their own copy of the plain weights, which quant.c
+ * needs), so float and double builds have their own SNAPSHOT_FILE.
+ *
+ * Layers that use packed weights from the mapping have packed_mapped set,
+ * so conv_free_packed and fc_free_packed leave them to the munmap in
+ * free_network.
+ *
+ * The binary snapshot is only a cache of the text files. If any of those is
+ * newer, load_cnn_snapshot warns and loads the text files instead (see
+ * snapshot_stale).
+ */
+
+#define SNAPSHOT_MAGIC "CNNSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_LAYERS 4
+#ifdef CNN_FLOAT
+#define SNAPSHOT_FILE "../data/snapshot/cnn-float.snap"
+#else
+#define SNAPSHOT_FILE "../data/snapshot/cnn.snap"
+#endif
+
+typedef struct snapshot_layer {
+  uint32_t index;   // layer number in the network
+  uint32_t k;       // values per filter
+  uint32_t n;       // number of filters
+  uint32_t unused;
+  uint64_t weights, biases, packed, packed_bias;  // file offsets
+} snapshot_layer_t;
+
+typedef struct snapshot_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t real_size;  // sizeof(real_t)
+  uint32_t panel;      // GEMM_NR the weights were packed with
+  uint32_t num_layers;
+  snapshot_layer_t layer[SNAPSHOT_LAYERS];
+} snapshot_header_t;
+
+/*
+ * The parameters of one layer with weights, whichever type it is.
+ */
+
+typedef struct snapshot_ref {
+  int index, k, n;
+  vol_t** filters;
+  vol_t* biases;
+  real_t** packed;
+  real_t** packed_bias;
+  int* packed_mapped;
+} snapshot_ref_t;
+
+static void snapshot_refs(network_t* net, snapshot_ref_t* refs) {
+  conv_layer_t* conv[3] = { net->l0, net->l3, net->l6 };
+  for (int i = 0; i < 3; i++) {
+    conv_layer_t* l = conv[i];
+    snapshot_ref_t r = { 3 * i, l->sx * l->sy * l->in_depth, l->out_depth,
+                         l->filters, l->biases, &l->packed, &l->packed_bias,
+                         &l->packed_mapped };
+    refs[i] = r;
+  }
+  fc_layer_t* l = net->l9;
+  snapshot_ref_t r = { 9, l->num_inputs, l->out_depth,
+                       l->filters, l->biases, &l->packed, &l->packed_bias,
+                       &l->packed_mapped };
+  refs[3] = r;
+}
+
+static uint64_t snapshot_align(uint64_t offset) {
+  return (offset + 63) & ~(uint64_t)63;
+}
+
+/*
+ * Zero fill the file up to offset.
+ */
+
+static void snapshot_pad(FILE* f, uint64_t offset) {
+  while ((uint64_t)ftell(f) < offset)
+    fputc(0, f);
+}
+
+/*
+ * Write the weights of a loaded network to fn. Returns 0 on success.
+ */
+
+int snapshot_save(network_t* net, const char* fn) {
+  snapshot_ref_t refs[SNAPSHOT_LAYERS];
+  snapshot_refs(net, refs);
+
+  snapshot_header_t h;
+  memset(&h, 0, sizeof(h));
+  strcpy(h.magic, SNAPSHOT_MAGIC);
+  h.version = SNAPSHOT_VERSION;
+  h.real_size = sizeof(real_t);
+  h.panel = GEMM_NR;
+  h.num_layers = SNAPSHOT_LAYERS;
+
+  uint64_t offset = snapshot_align(sizeof(h));
+  for (int i = 0; i < SNAPSHOT_LAYERS; i++) {
+    snapshot_layer_t* s = &h.layer[i];
+    s->index = refs[i].index;
+    s->k = refs[i].k;
+    s->n = refs[i].n;
+    s->weights = offset;
+    s->biases = snapshot_align(s->weights + sizeof(real_t) * s->k * s->n);
+    s->packed = snapshot_align(s->biases + sizeof(real_t) * s->n);
+    s->packed_bias = snapshot_align(s->packed + sizeof(real_t) * gemm_packed_size(s->k, s->n));
+    offset = snapshot_align(s->packed_bias + sizeof(real_t) * gemm_packed_size(1, s->n));
+  }
+
+  FILE* f = fopen(fn, "wb");
+  if (f == NULL)
+    return -1;
+
+  fwrite(&h, 1, sizeof(h), f);
+  for (int i = 0; i < SNAPSHOT_LAYERS; i++) {
+    snapshot_layer_t* s = &h.layer[i];
+    for (int j = 0; j < s->n; j++) {
+      snapshot_pad(f, s->weights + sizeof(real_t) * s->k * j);
+      fwrite(refs[i].filters[j]->w, sizeof(real_t), s->k, f);
+    }
+    snapshot_pad(f, s->biases);
+    fwrite(refs[i].biases->w, sizeof(real_t), s->n, f);
+    snapshot_pad(f, s->packed);
+    fwrite(*refs[i].packed, sizeof(real_t), gemm_packed_size(s->k, s->n), f);
+    snapshot_pad(f, s->packed_bias);
+    fwrite(*refs[i].packed_bias, sizeof(real_t), gemm_packed_size(1, s->n), f);
+  }
+  snapshot_pad(f, offset);
+
+  return (fclose(f) == 0) ? 0 : -1;
+}
+
+/*
+ * Map fn and load the weights of net from it. Returns 0 on success, and -1
+ * if there is no such file or it doesn't fit the network (after printing
+ * why), in which case net is unchanged. The mapping is released by
+ * free_network.
+ */
+
+int snapshot_load(network_t* net, const char* fn) {
+  int fd = open(fn, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(snapshot_header_t)) {
+    fprintf(stderr, "Ignoring %s: truncated\n", fn);
+    close(fd);
+    return -1;
+  }
+
+  char* base = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return -1;
+
+  const snapshot_header_t* h = (const snapshot_header_t*)base;
+  const char* error = NULL;
+  if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+    error = "not a snapshot";
+  else if (h->version != SNAPSHOT_VERSION)
+    error = "unsupported version";
+  else if (h->real_size != sizeof(real_t))
+    error = "written for the other precision";
+  else if (h->panel == 0 || h->num_layers != SNAPSHOT_LAYERS)
+    error = "bad header";
+
+  snapshot_ref_t refs[SNAPSHOT_LAYERS];
+  snapshot_refs(net, refs);
+  for (int i = 0; i < SNAPSHOT_LAYERS && error == NULL; i++) {
+    const snapshot_layer_t* s = &h->layer[i];
+    uint64_t np = (s->n + h->panel - 1) / h->panel * h->panel;
+    if (s->index != refs[i].index || s->k != refs[i].k || s->n != refs[i].n)
+      error = "layers don't match the network";
+    else if (s->weights + sizeof(real_t) * s->k * s->n > (uint64_t)st.st_size ||
+             s->biases + sizeof(real_t) * s->n > (uint64_t)st.st_size ||
+             s->packed + sizeof(real_t) * s->k * np > (uint64_t)st.st_size ||
+             s->packed_bias + sizeof(real_t) * np > (uint64_t)st.st_size)
+      error = "truncated";
+  }
+
+  if (error != NULL) {
+    fprintf(stderr, "Ignoring %s: %s\n", fn, error);
+    munmap(base, st.st_size);
+    return -1;
+  }
+
+  for (int i = 0; i < SNAPSHOT_LAYERS; i++) {
+    const snapshot_layer_t* s = &h->layer[i];
+    snapshot_ref_t* r = &refs[i];
+    for (int j = 0; j < r->n; j++)
+      memcpy(r->filters[j]->w, base + s->weights + sizeof(real_t) * r->k * j,
+             sizeof(real_t) * r->k);
+    memcpy(r->biases->w, base + s->biases, sizeof(real_t) * r->n);
+
+    if (!*r->packed_mapped) {
+      _mm_free(*r->packed);
+      _mm_free(*r->packed_bias);
+    }
+    *r->packed_mapped = (h->panel == (uint32_t)GEMM_NR);
+    if (*r->packed_mapped) {
+      *r->packed = (real_t*)(base + s->packed);
+      *r->packed_bias = (real_t*)(base + s->packed_bias);
+    } else {
+      real_t* cols[r->n];
+      for (int j = 0; j < r->n; j++)
+        cols[j] = r->filters[j]->w;
+      *r->packed = gemm_pack_b(cols, r->k, r->n);
+      *r->packed_bias = gemm_pack_bias(r->biases->w, r->n);
+    }
+  }
+
+  if (net->snapshot != NULL)
+    munmap(net->snapshot, net->snapshot_size);
+  net->snapshot = base;
+  net->snapshot_size = st.st_size;
+  return 0;
+}
+
+/*
+ * Whether one of the n files in text was modified after the snapshot fn, so
+ * fn may no longer hold their weights. If so, *newer is set to that file.
+ * Returns 0 if there is no fn.
+ */
+
+int snapshot_stale(const char* fn, const char* const* text, int n,
+                   const char** newer) {
+  struct stat snap, st;
+  if (stat(fn, &snap) != 0)
+    return 0;
+
+  for (int i = 0; i < n; i++) {
+    if (stat(text[i], &st) == 0 &&
+        (st.st_mtim.tv_sec > snap.st_mtim.tv_sec ||
+         (st.st_mtim.tv_sec == snap.st_mtim.tv_sec &&
+          st.st_mtim.tv_nsec > snap.st_mtim.tv_nsec))) {
+      *newer = text[i];
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -1,4 +1,5 @@
 #include <sys/time.h>
+#include <time.h>
 
 /*
  * Get a current timestamp with us accuracy. This will give you the time that
@@ -12,3 +13,14 @@ inline uint64_t timestamp_us() {
   gettimeofday(&tv,NULL);
   return 1000000L * tv.tv_sec + tv.tv_usec;
 }
+
+/*
+ * Same with ns resolution, from a monotonic clock, for timing short pieces
+ * of code like single layers.
+ */
+
+static inline uint64_t timestamp_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return 1000000000L * ts.tv_sec + ts.tv_nsec;
+}
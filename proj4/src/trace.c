@@ -0,0 +1,126 @@
+// Tracing --------------------------------------------------------------------
+
+/*
+ * A timeline of what every thread did, for finding load imbalance and
+ * stragglers. Setting CNN_TRACE to a file name records a span for every
+ * layer net_forward runs, every batch of images a worker classifies, and
+ * every batch file load_batch maps. The spans are written to the file as
+ * Chrome trace events (chrome://tracing or ui.perfetto.dev) when the process
+ * exits.
+ *
+ * Every thread appends to a buffer of its own, so recording takes no locks
+ * (only a thread's first span registers its buffer). Without CNN_TRACE, a
+ * span costs one load and branch.
+ */
+
+typedef struct trace_span {
+  const char* name;
+  int id;            // appended to the name if >= 0
+  const char* key;   // name of the argument, or NULL
+  int value;
+  uint64_t begin_ns, end_ns;
+} trace_span_t;
+
+typedef struct trace_buf {
+  int tid;
+  int worker;        // scheduler worker id, or -1
+  int n, cap;
+  trace_span_t* spans;
+  struct trace_buf* next;
+} trace_buf_t;
+
+static int trace_on = 0;
+static const char* trace_file = NULL;
+static uint64_t trace_start_ns;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_buf_t* trace_bufs = NULL;
+static int trace_num_bufs = 0;
+static __thread trace_buf_t* trace_self = NULL;
+
+static void trace_write(void);
+
+static void trace_init(void) {
+  trace_file = getenv("CNN_TRACE");
+  if (trace_file == NULL || *trace_file == '\0')
+    return;
+  trace_start_ns = timestamp_ns();
+  atexit(trace_write);
+  trace_on = 1;
+}
+
+static inline uint64_t trace_begin(void) {
+  pthread_once(&trace_once, trace_init);
+  return trace_on ? timestamp_ns() : 0;
+}
+
+/*
+ * Record a span from t0 (as returned by trace_begin) until now.
+ */
+
+static void trace_end(const char* name, int id, const char* key, int value, uint64_t t0) {
+  if (t0 == 0)
+    return;
+  uint64_t now = timestamp_ns();
+
+  trace_buf_t* b = trace_self;
+  if (b == NULL) {
+    b = (trace_buf_t*)calloc(1, sizeof(trace_buf_t));
+    b->worker = sched_worker_id();
+    pthread_mutex_lock(&trace_lock);
+    b->tid = trace_num_bufs++;
+    b->next = trace_bufs;
+    trace_bufs = b;
+    pthread_mutex_unlock(&trace_lock);
+    trace_self = b;
+  }
+  if (b->n == b->cap) {
+    b->cap = (b->cap > 0) ? 2 * b->cap : 1024;
+    b->spans = (trace_span_t*)realloc(b->spans, sizeof(trace_span_t) * b->cap);
+  }
+  trace_span_t s = { name, id, key, value, t0, now };
+  b->spans[b->n++] = s;
+}
+
+/*
+ * Write all spans as complete ("X") events, with timestamps in us since the
+ * start of the trace, and name every thread by its scheduler worker id.
+ * Runs at exit, when the workers are idle.
+ */
+
+static void trace_write(void) {
+  FILE* f = fopen(trace_file, "w");
+  if (f == NULL) {
+    fprintf(stderr, "ERROR: Could not write trace %s\n", trace_file);
+    return;
+  }
+
+  pthread_mutex_lock(&trace_lock);
+  int events = 0;
+  fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+  for (trace_buf_t* b = trace_bufs; b != NULL; b = b->next) {
+    fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+            "\"args\": {\"name\": \"", (events++ > 0) ? ",\n" : "", b->tid);
+    if (b->worker >= 0)
+      fprintf(f, "worker %d\"}}", b->worker);
+    else
+      fprintf(f, "thread %d\"}}", b->tid);
+
+    for (int i = 0; i < b->n; i++) {
+      trace_span_t* s = &b->spans[i];
+      fprintf(f, ",\n{\"name\": \"%s", s->name);
+      if (s->id >= 0)
+        fprintf(f, " %d", s->id);
+      fprintf(f, "\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+              b->tid, (s->begin_ns - trace_start_ns) / 1e3, (s->end_ns - s->begin_ns) / 1e3);
+      if (s->key != NULL)
+        fprintf(f, ", \"args\": {\"%s\": %d}", s->key, s->value);
+      fprintf(f, "}");
+    }
+  }
+  fprintf(f, "\n]}\n");
+  pthread_mutex_unlock(&trace_lock);
+
+  fclose(f);
+  fprintf(stderr, "Wrote trace %s\n", trace_file);
+}
@@ -14,100 +14,158 @@ void dump_vol(vol_t* v) {
   printf("\n");
 }
 
-// Load the snapshot of the CNN we are going to run.
-network_t* load_cnn_snapshot() {
-  network_t* net = make_network();
-  conv_load(net->l0, "../data/snapshot/layer1_conv.txt");
-  conv_load(net->l3, "../data/snapshot/layer4_conv.txt");
-  conv_load(net->l6, "../data/snapshot/layer7_conv.txt");
-  fc_load(net->l9, "../data/snapshot/layer10_fc.txt");
+// The text snapshot, one file per layer with weights.
+static const char* const text_snapshot[4] = {
+  "../data/snapshot/layer1_conv.txt",
+  "../data/snapshot/layer4_conv.txt",
+  "../data/snapshot/layer7_conv.txt",
+  "../data/snapshot/layer10_fc.txt",
+};
+
+// Load the weights of the network from the text snapshot.
+void load_cnn_text(network_t* net) {
+  conv_load(net->l0, text_snapshot[0]);
+  conv_load(net->l3, text_snapshot[1]);
+  conv_load(net->l6, text_snapshot[2]);
+  fc_load(net->l9, text_snapshot[3]);
+}
+
+// Load the snapshot of the CNN we are going to run (flags as for make_network),
+// from the binary snapshot if there is an up to date one (see snapshot.c) and
+// from the text files otherwise.
+network_t* load_cnn_snapshot(int flags) {
+  network_t* net = make_network(flags);
+  const char* newer;
+  if (snapshot_stale(SNAPSHOT_FILE, text_snapshot, 4, &newer)) {
+    fprintf(stderr, "Ignoring %s: %s is newer (run cnn convert)\n",
+            SNAPSHOT_FILE, newer);
+    load_cnn_text(net);
+  } else if (snapshot_load(net, SNAPSHOT_FILE) != 0) {
+    load_cnn_text(net);
+  }
   return net;  
 }
 
-// Load an image from the cifar10 data set.
-void load_sample(vol_t *v, int sample_num) {
-  fprintf(stderr, "Loading input sample %d...\n", sample_num);
-  
-  int batch = sample_num / 10000;
-  int ix = sample_num % 10000;
+// The cifar10 data set is divided into 5 batch files with 10,000 records
+// each. A record is the label byte followed by the raw image (see
+// image_to_vol).
+#define BATCH_IMAGES 10000
+#define RECORD_SIZE 3073
+
+// Map a batch file into memory. Pages are only read from disk when an image
+// in them is used, and they are shared with the page cache.
+const uint8_t* load_batch(int batch) {
+  fprintf(stderr, "Mapping input batch %d...\n", batch);
+  uint64_t t0 = trace_begin();
 
   char fn[1024];
   sprintf(fn, "%s/data_batch_%d.bin", DATA_FOLDER, batch+1);
 
-  FILE* fin = fopen(fn, "rb");
-  assert(fin != NULL);
-
-  fseek(fin, ix*3073, SEEK_SET);
+  int fd = open(fn, O_RDONLY);
+  assert(fd >= 0);
+  void* map = mmap(NULL, (size_t)BATCH_IMAGES * RECORD_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+  assert(map != MAP_FAILED);
+  close(fd);
+  trace_end("load_batch", batch, NULL, 0, t0);
 
-  uint8_t data[3073];
-  assert(fread(data, 1, 3073, fin) == 3073);
+  return (const uint8_t*)map;
+}
 
-  int outp = 1;
-  for (int z = 0; z < 3; z++)
-    for (int y = 0; y < 32; y++)
-      for (int x = 0; x < 32; x++) {
-        set_vol(v, x, y, z, ((double)data[outp++])/255.0-0.5);
-      }
+const uint8_t* batches[50];
 
-  fclose(fin);
+// Look up the raw image of a sample, mapping its batch file if needed.
+const uint8_t* get_image(int sample_num) {
+  int batch = sample_num / BATCH_IMAGES;
+  if (batches[batch] == NULL)
+    batches[batch] = load_batch(batch);
+  return batches[batch] + (size_t)(sample_num % BATCH_IMAGES) * RECORD_SIZE + 1;
 }
 
-// Load an entire batch of images from the cifar10 data set (which is divided
-// into 5 batches with 10,000 images each).
-vol_t** load_batch(int batch) {
-  fprintf(stderr, "Loading input batch %d...\n", batch);
+// Load an image from the cifar10 data set.
+void load_sample(vol_t *v, int sample_num) {
+  fprintf(stderr, "Loading input sample %d...\n", sample_num);
+  image_to_vol(v, get_image(sample_num));
+}
 
-  char fn[1024];
-  sprintf(fn, "%s/data_batch_%d.bin", DATA_FOLDER, batch+1);
+// Look up the raw images of the given samples. The returned array has to be
+// freed, the images are owned by the batch mappings.
+const uint8_t** get_samples(int* samples, int n) {
+  const uint8_t** input = (const uint8_t**)malloc(sizeof(uint8_t*)*n);
+  for (int i = 0; i < n; i++) {
+    input[i] = get_image(samples[i]);
+  }
 
-  FILE* fin = fopen(fn, "rb");
-  assert(fin != NULL);
-  vol_t** batchdata = (vol_t**)malloc(sizeof(vol_t*) * 10000);
+  return input;
+}
 
-  for (int i = 0; i < 10000; i++) {
-    batchdata[i] = make_vol(32, 32, 3, 0.0);
+// Same as get_samples, but converting the images to volumes, which have to
+// be freed with free_sample_vols.
+vol_t** get_sample_vols(int* samples, int n) {
+  vol_t** input = (vol_t**)malloc(sizeof(vol_t*)*n);
+  for (int i = 0; i < n; i++) {
+    input[i] = make_vol(32, 32, 3, 0.0);
+    image_to_vol(input[i], get_image(samples[i]));
+  }
 
-    uint8_t data[3073];
-    assert(fread(data, 1, 3073, fin) == 3073);
+  return input;
+}
 
-    int outp = 1;
-    for (int z = 0; z < 3; z++)
-      for (int y = 0; y < 32; y++)
-        for (int x = 0; x < 32; x++) {
-          set_vol(batchdata[i], x, y, z, ((double)data[outp++])/255.0-0.5);
-        }
-  }
+void free_sample_vols(vol_t** input, int n) {
+  for (int i = 0; i < n; i++)
+    free_vol(input[i]);
+  free(input);
+}
 
-  fclose(fin);
+// A list of samples as a stream for net_classify_stream, which writes the cat
+// likelihood of every sample into output.
+typedef struct sample_stream {
+  int* samples;
+  int n;
+  int pos;
+  double* output;
+} sample_stream_t;
+
+static int sample_source(void* ctx, const uint8_t** img, int max) {
+  sample_stream_t* s = (sample_stream_t*)ctx;
+  int count = (s->n - s->pos < max) ? s->n - s->pos : max;
+  for (int j = 0; j < count; j++)
+    img[j] = get_image(s->samples[s->pos + j]);
+  s->pos += count;
+  return count;
+}
 
-  return batchdata;
+static void sample_sink(void* ctx, int first, vol_t** out, int count) {
+  sample_stream_t* s = (sample_stream_t*)ctx;
+  for (int j = 0; j < count; j++)
+    s->output[first + j] = out[j]->w[CAT_LABEL];
 }
 
-vol_t** batches[50];
+// Write the cat likelihood of the given samples into output, loading the
+// images while the network runs.
+void classify_samples(network_t* net, int* samples, int n, double* output) {
+  if (net_split_images(net, n)) {
+    // A few images (e.g., an interactive request): split every image across
+    // the workers for latency. There is nothing to overlap the loading with.
+    const uint8_t** input = get_samples(samples, n);
+    net_classify_images(net, input, output, n);
+    free((void*)input);
+  } else {
+    sample_stream_t stream = { samples, n, 0, output };
+    net_classify_stream(net, sample_source, sample_sink, &stream);
+  }
+}
 
-// Perform the classification (this calls into the functions from cnn.c
+// Perform the classification (this calls into the functions from cnn.c). The
+// images are loaded while the network runs, so the time includes loading.
 double run_classification(int* samples, int n, double** keep_output) {
   fprintf(stderr, "Making network...\n");
-  network_t* net = load_cnn_snapshot();
+  network_t* net = load_cnn_snapshot(NET_FUSED | NET_HALO);
 
-  fprintf(stderr, "Loading batches...\n");
-  for (int i = 0; i < n; i++) {
-    int batch = samples[i]/10000;
-    if (batches[batch] == NULL) {
-      batches[batch] = load_batch(batch);
-    }
-  }
-
-  vol_t** input = (vol_t**)malloc(sizeof(vol_t*)*n);
   double* output = (double*)malloc(sizeof(double)*n);
 
-  for (int i = 0; i < n; i++) {
-    input[i] = batches[samples[i]/10000][samples[i]%10000];
-  }
-
   fprintf(stderr, "Running classification...\n");
   uint64_t start_time = timestamp_us(); 
-  net_classify_cats(net, input, output, n);
+  classify_samples(net, samples, n, output);
   uint64_t end_time = timestamp_us();
 
   for (int i = 0; i < n; i++) {
@@ -118,7 +176,6 @@ double run_classification(int* samples, int n, double** keep_output) {
   fprintf(stderr, "TIME: %lf ms\n", dt);
 
   free_network(net);
-  free(input);
 
   if (keep_output == NULL)
     free(output);
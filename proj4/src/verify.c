@@ -0,0 +1,303 @@
+// Reference Activations ------------------------------------------------------
+
+/*
+ * `cnn test` prints every volume of one sample as text, which is compared
+ * against test/ref/<N>.txt by compare_layers.py. That takes seconds per
+ * sample. A reference file holds the same volumes of any number of samples
+ * in binary, and `cnn verify` checks a network against all of them in
+ * process and in parallel.
+ *
+ * The file starts with a refs_header_t, followed by the sample numbers
+ * (int32_t), and then, 64 byte aligned, the volumes of one sample after the
+ * other. The volumes of a sample are stored layer after layer, as doubles in
+ * the order of dump_vol (x, then y, then depth), whatever the precision of
+ * the build. A sample takes about 435 KB, so 1000 samples take 435 MB. The
+ * file is mapped with mmap, so only the pages of the samples being checked
+ * have to be in memory.
+ */
+
+#define REFS_MAGIC "CNNREFS"
+#define REFS_VERSION 1
+
+typedef struct refs_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_vols;       // LAYERS+1
+  uint32_t num_samples;
+  uint32_t values;         // doubles per sample
+  uint32_t dims[LAYERS+1][3];
+  uint64_t data;           // file offset of the first sample
+} refs_header_t;
+
+typedef struct refs {
+  const refs_header_t* header;
+  const int32_t* samples;
+  const double* data;
+  size_t size;
+} refs_t;
+
+/*
+ * First value of a sample that differs from the reference by more than the
+ * tolerance.
+ */
+
+typedef struct refs_diff {
+  int layer;               // -1 if the sample matches
+  int x, y, d;
+  double value, expected;
+  double max_err;          // largest error over all layers
+} refs_diff_t;
+
+// Number of doubles of all volumes of one sample.
+static int refs_values(network_t* net) {
+  int n = 0;
+  for (int i = 0; i < LAYERS+1; i++)
+    n += (int)vol_size(net->v[i]);
+  return n;
+}
+
+static uint64_t refs_data_offset(int num_samples) {
+  return snapshot_align(sizeof(refs_header_t) + sizeof(int32_t) * num_samples);
+}
+
+/*
+ * Copy a volume into out in the order of dump_vol.
+ */
+
+static double* vol_to_refs(vol_t* v, double* out) {
+  for (int x = 0; x < (int)v->sx; x++)
+    for (int y = 0; y < (int)v->sy; y++)
+      for (int z = 0; z < (int)v->depth; z++)
+        *out++ = get_vol(v, x, y, z);
+  return out;
+}
+
+/*
+ * Create a reference file for the given samples and write everything up to
+ * the volumes, which the caller appends (values doubles per sample, in the
+ * order of samples). Returns NULL if the file can't be written.
+ */
+
+FILE* refs_create(network_t* net, const char* fn, const int32_t* samples, int n) {
+  FILE* f = fopen(fn, "wb");
+  if (f == NULL)
+    return NULL;
+
+  refs_header_t h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, REFS_MAGIC, sizeof(REFS_MAGIC));
+  h.version = REFS_VERSION;
+  h.num_vols = LAYERS+1;
+  h.num_samples = n;
+  h.values = refs_values(net);
+  for (int i = 0; i < LAYERS+1; i++) {
+    h.dims[i][0] = net->v[i]->sx;
+    h.dims[i][1] = net->v[i]->sy;
+    h.dims[i][2] = net->v[i]->depth;
+  }
+  h.data = refs_data_offset(n);
+  fwrite(&h, sizeof(h), 1, f);
+
+  fwrite(samples, sizeof(int32_t), n, f);
+  snapshot_pad(f, h.data);
+  return f;
+}
+
+/*
+ * Map the reference file fn. Returns 0 on success, and -1 if it can't be
+ * read or doesn't fit net (after printing why).
+ */
+
+int refs_open(refs_t* refs, network_t* net, const char* fn) {
+  int fd = open(fn, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: Could not open %s\n", fn);
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(refs_header_t)) {
+    fprintf(stderr, "ERROR: %s is truncated\n", fn);
+    close(fd);
+    return -1;
+  }
+
+  char* base = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return -1;
+
+  const refs_header_t* h = (const refs_header_t*)base;
+  const char* error = NULL;
+  if (memcmp(h->magic, REFS_MAGIC, sizeof(REFS_MAGIC)) != 0)
+    error = "not a reference file";
+  else if (h->version != REFS_VERSION)
+    error = "unsupported version";
+  else if (h->num_vols != LAYERS+1 || h->values != (uint32_t)refs_values(net))
+    error = "volumes don't match the network";
+  else if (h->data != refs_data_offset(h->num_samples) ||
+           h->data + sizeof(double) * h->values * h->num_samples > (uint64_t)st.st_size)
+    error = "truncated";
+  for (int i = 0; i < LAYERS+1 && error == NULL; i++)
+    if (h->dims[i][0] != net->v[i]->sx || h->dims[i][1] != net->v[i]->sy ||
+        h->dims[i][2] != net->v[i]->depth)
+      error = "volumes don't match the network";
+
+  if (error != NULL) {
+    fprintf(stderr, "ERROR: %s: %s\n", fn, error);
+    munmap(base, st.st_size);
+    return -1;
+  }
+
+  refs->header = h;
+  refs->samples = (const int32_t*)(base + sizeof(refs_header_t));
+  refs->data = (const double*)(base + h->data);
+  refs->size = st.st_size;
+  return 0;
+}
+
+void refs_close(refs_t* refs) {
+  munmap((void*)refs->header, refs->size);
+}
+
+/*
+ * Compare volume v against the reference values starting at ref (in the
+ * order of dump_vol), updating diff. Returns the values after the volume.
+ */
+
+static const double* refs_compare_vol(vol_t* v, const double* ref, int layer, double tolerance,
+                                      refs_diff_t* diff) {
+  for (int x = 0; x < (int)v->sx; x++)
+    for (int y = 0; y < (int)v->sy; y++)
+      for (int z = 0; z < (int)v->depth; z++) {
+        double value = get_vol(v, x, y, z);
+        double err = fabs(value - *ref);
+        if (!(err <= diff->max_err))
+          diff->max_err = err;
+        if (!(err <= tolerance) && diff->layer < 0) {
+          refs_diff_t first = { layer, x, y, z, value, *ref, diff->max_err };
+          *diff = first;
+        }
+        ref++;
+      }
+  return ref;
+}
+
+typedef struct refs_job {
+  network_t* net;
+  const int32_t* samples;
+  const uint8_t** images;  // of the samples
+  int n;
+  double* out;             // where to store the volumes, or
+  const double* refs;      // what to compare them with
+  double tolerance;
+  refs_diff_t* diffs;
+} refs_job_t;
+
+static void refs_batch(void* ctx, int b, int worker) {
+  refs_job_t* job = (refs_job_t*)ctx;
+  network_t* net = job->net;
+  batch_t* batch = net_workspace(net, worker)->batch;
+  int bs = net->batch_size;
+  int first = b * bs;
+  int count = (job->n - first < bs) ? job->n - first : bs;
+  size_t values = refs_values(net);
+
+  uint64_t t0 = trace_begin();
+  for (int j = 0; j < count; j++)
+    image_to_vol(batch[0][j], job->images[first + j]);
+  net_forward(net, batch, 0, count - 1);
+
+  for (int j = 0; j < count; j++) {
+    if (job->out != NULL) {
+      double* out = job->out + (first + j) * values;
+      for (int i = 0; i < LAYERS+1; i++)
+        out = vol_to_refs(batch[i][j], out);
+    } else {
+      const double* ref = job->refs + (first + j) * values;
+      refs_diff_t* diff = &job->diffs[first + j];
+      diff->layer = -1;
+      diff->max_err = 0.0;
+      for (int i = 0; i < LAYERS+1; i++)
+        ref = refs_compare_vol(batch[i][j], ref, i, job->tolerance, diff);
+    }
+  }
+  trace_end("refs", -1, "first", first, t0);
+}
+
+static void refs_run(refs_job_t* job) {
+  network_t* net = job->net;
+  assert(!(net->flags & NET_FUSED));
+  plan_memory(net, 1, &net->plan);
+  net_reserve_workspaces(net, sched_num_workers());
+  int bs = net->batch_size;
+
+  // Map the batch files here, get_image isn't thread safe.
+  job->images = (const uint8_t**)malloc(sizeof(uint8_t*) * job->n);
+  for (int i = 0; i < job->n; i++)
+    job->images[i] = get_image(job->samples[i]);
+  sched_parallel_for((job->n + bs - 1) / bs, 1, refs_batch, job);
+  free((void*)job->images);
+}
+
+/*
+ * Run n samples through net on all workers, and store their volumes in out
+ * (refs_values doubles per sample). net has to be unfused, so that every
+ * volume is computed.
+ */
+
+void net_compute_refs(network_t* net, const int32_t* samples, int n, double* out) {
+  refs_job_t job = { net, samples, NULL, n, out, NULL, 0.0, NULL };
+  refs_run(&job);
+}
+
+/*
+ * Run all samples of refs through net (unfused as well) on all workers, and
+ * store the first difference of every sample in diffs. Returns the number
+ * of samples that differ.
+ */
+
+int net_verify_refs(network_t* net, const refs_t* refs, double tolerance, refs_diff_t* diffs) {
+  int n = refs->header->num_samples;
+  refs_job_t job = { net, refs->samples, NULL, n, NULL, refs->data, tolerance, diffs };
+  refs_run(&job);
+
+  int failed = 0;
+  for (int i = 0; i < n; i++)
+    if (diffs[i].layer >= 0)
+      failed++;
+  return failed;
+}
+
+/*
+ * Read the volumes of a text reference (test/ref/<N>.txt, as printed by
+ * `cnn test`) into out. Returns 0 on success, and -1 if the file can't be
+ * read or doesn't fit net.
+ */
+
+int refs_read_text(network_t* net, const char* fn, double* out) {
+  FILE* f = fopen(fn, "r");
+  if (f == NULL)
+    return -1;
+
+  int err = 0;
+  for (int i = 0; i < LAYERS+1 && !err; i++) {
+    int layer;
+    long sx, sy, depth;
+    if (fscanf(f, " LAYER%d,%ld,%ld,%ld", &layer, &sx, &sy, &depth) != 4 || layer != i ||
+        sx != (long)net->v[i]->sx || sy != (long)net->v[i]->sy ||
+        depth != (long)net->v[i]->depth) {
+      err = -1;
+      break;
+    }
+    for (long k = 0; k < sx * sy * depth; k++) {
+      if (fscanf(f, ",%lf", out++) != 1) {
+        err = -1;
+        break;
+      }
+    }
+  }
+
+  fclose(f);
+  return err;
+}